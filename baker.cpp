@@ -0,0 +1,246 @@
+#include <GL/glew.h>
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <model.h>
+#include <mesh_cache.h>
+#include <mesh_optimizer.h>
+#include <texture_compressor.h>
+#include <thread_pool.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Headless asset baker. Models become .meshcache files with geometry run
+// through MeshOptimizer; images become BC1/BC3 .dds files with a full mip
+// chain. Model materials are rewritten to point at the baked textures, so
+// the output directory can be loaded directly with
+// Model("<output>/<model file name>").
+//
+//   baker [-o output] [-j threads] [-v] inputs...
+//
+// -v prints the vertex cache statistics of every mesh.
+
+namespace fs = std::filesystem;
+
+struct ManifestEntry {
+    std::string type, source, output;
+    std::uintmax_t bytes;
+};
+
+std::mutex manifestMutex;
+std::vector<ManifestEntry> manifest;
+std::atomic<int> failures = 0;
+
+void record(const std::string &type, const fs::path &source,
+            const fs::path &output) {
+    std::error_code error;
+    std::uintmax_t bytes = fs::file_size(output, error);
+    std::lock_guard<std::mutex> lock(manifestMutex);
+    manifest.push_back(
+        {type, source.generic_string(), output.generic_string(), bytes});
+}
+
+bool isImage(const fs::path &path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    for (const char *image : {".png", ".jpg", ".jpeg", ".tga", ".bmp", ".psd",
+                              ".gif", ".hdr", ".pic", ".pnm"}) {
+        if (extension == image) return true;
+    }
+    return false;
+}
+
+fs::path bakedTextureName(const std::string &texture) {
+    return fs::path(texture).replace_extension(".dds");
+}
+
+// The texture's path relative to the model's directory, or an empty path
+// if it lies outside, where its baked copy would escape the output
+// directory.
+fs::path containedTexturePath(const fs::path &directory,
+                              const std::string &texture) {
+    std::string generic = texture;
+    std::replace(generic.begin(), generic.end(), '\\', '/');
+    fs::path base = directory.lexically_normal();
+    fs::path relative =
+        (base / generic).lexically_normal().lexically_relative(base);
+    if (relative.empty() || relative == "." || *relative.begin() == "..")
+        return {};
+    return relative;
+}
+
+bool bakeTexture(const fs::path &source, const fs::path &output) {
+    RGBAImage image;
+    int components;
+    unsigned char *pixels = stbi_load(source.string().c_str(), &image.width,
+                                      &image.height, &components, 4);
+    if (!pixels) {
+        std::cerr << "ERROR LOADING TEXTURE AT " << source << std::endl;
+        return false;
+    }
+    image.pixels.assign(pixels,
+                        pixels + size_t(image.width) * image.height * 4);
+    stbi_image_free(pixels);
+
+    BlockFormat format = BC1;
+    for (size_t i = 3; i < image.pixels.size(); i += 4) {
+        if (image.pixels[i] != 255) {
+            format = BC3;
+            break;
+        }
+    }
+    int width = image.width, height = image.height;
+    std::vector<std::vector<unsigned char>> levels;
+    for (const RGBAImage &level : buildMipChain(std::move(image)))
+        levels.push_back(compressImage(level, format));
+
+    fs::create_directories(output.parent_path());
+    if (!writeDDS(output.string(), format, width, height, levels))
+        return false;
+    record("texture", source, output);
+    return true;
+}
+
+// Returns the source/output pairs of the textures the model references.
+std::vector<std::pair<fs::path, fs::path>> bakeModel(const fs::path &source,
+                                                     const fs::path &output) {
+    std::vector<std::pair<fs::path, fs::path>> textures;
+    ModelData model;
+    if (!importModel(fs::absolute(source).generic_string(), model)) {
+        failures++;
+        return textures;
+    }
+    for (MeshData &mesh : model.meshes) {
+        for (TextureRef &ref : mesh.textures) {
+            fs::path relative = containedTexturePath(model.directory, ref.path);
+            if (relative.empty()) {
+                std::cerr << "ERROR TEXTURE OUTSIDE MODEL DIRECTORY: "
+                          << ref.path << " in " << source << std::endl;
+                failures++;
+                continue;
+            }
+            fs::path baked = bakedTextureName(relative.string());
+            textures.push_back(
+                {(fs::path(model.directory) / relative).lexically_normal(),
+                 output.parent_path() / baked});
+            ref.path = baked.generic_string();
+        }
+    }
+    fs::path file = MeshCache::pathFor(output.string());
+    fs::create_directories(file.parent_path());
+    if (!MeshCache::write(file.string(), model)) {
+        failures++;
+        return textures;
+    }
+    record("model", source, file);
+    return textures;
+}
+
+bool writeManifest(const fs::path &file) {
+    std::sort(manifest.begin(), manifest.end(),
+              [](const ManifestEntry &a, const ManifestEntry &b) {
+                  return a.output < b.output;
+              });
+    auto quote = [](const std::string &text) {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            quoted += c;
+        }
+        return quoted + '"';
+    };
+    std::ofstream out(file);
+    out << "[\n";
+    for (size_t i = 0; i < manifest.size(); i++) {
+        const ManifestEntry &entry = manifest[i];
+        out << "  {\"type\": " << quote(entry.type)
+            << ", \"source\": " << quote(entry.source)
+            << ", \"output\": " << quote(entry.output)
+            << ", \"bytes\": " << entry.bytes << "}"
+            << (i + 1 < manifest.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+    return bool(out);
+}
+
+int main(int argc, char **argv) {
+    fs::path outputDirectory = "baked";
+    unsigned int threads = std::thread::hardware_concurrency();
+    std::vector<fs::path> inputs;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            outputDirectory = argv[++i];
+        else if (arg == "-j" && i + 1 < argc)
+            threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "-v")
+            MeshOptimizer::report = true;
+        else
+            inputs.push_back(arg);
+    }
+    if (inputs.empty()) {
+        std::cerr << "usage: " << argv[0]
+                  << " [-o output] [-j threads] [-v] inputs..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Match the orientation the renderer asks stb for, since compressed
+    // blocks are uploaded as stored.
+    stbi_set_flip_vertically_on_load(true);
+    MeshOptimizer::enabled = true;
+    ThreadPool pool(std::max(1u, threads));
+    fs::create_directories(outputDirectory);
+
+    // Models first, so the textures they share are baked only once. Keyed
+    // by output, as different sources, e.g. a.png and a.jpg, may map to
+    // the same baked file; the first one wins and the rest are reported.
+    std::map<fs::path, fs::path> textures;
+    auto claim = [&textures](const fs::path &output, const fs::path &source) {
+        auto [it, inserted] = textures.emplace(output, source);
+        if (inserted || it->second == source) return;
+        std::cerr << "ERROR TEXTURE NAME COLLISION: " << it->second << " and "
+                  << source << " both bake to " << output << std::endl;
+        failures++;
+    };
+    std::vector<std::future<std::vector<std::pair<fs::path, fs::path>>>>
+        models;
+    for (const fs::path &input : inputs) {
+        fs::path output = outputDirectory / input.filename();
+        if (isImage(input))
+            claim(bakedTextureName(output.string()),
+                  fs::absolute(input).lexically_normal());
+        else
+            models.push_back(pool.submit(
+                [input, output] { return bakeModel(input, output); }));
+    }
+    for (auto &model : models) {
+        for (auto &[source, output] : model.get()) claim(output, source);
+    }
+
+    std::vector<std::future<void>> images;
+    for (const auto &[output, source] : textures) {
+        images.push_back(pool.submit([source, output] {
+            if (!bakeTexture(source, output)) failures++;
+        }));
+    }
+    for (auto &image : images) image.get();
+
+    if (!writeManifest(outputDirectory / "manifest.json")) {
+        std::cerr << "ERROR WRITING MANIFEST" << std::endl;
+        failures++;
+    }
+    std::cout << "Baked " << manifest.size() << " assets into "
+              << outputDirectory << ", " << failures << " failed" << std::endl;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -13,9 +13,22 @@
 #include <shader.h>
 #include <camera.h>
 #include <model.h>
+#include <model_loader.h>
+#include <software_occlusion.h>
+#include <bvh.h>
+#include <cascaded_shadows.h>
+#include <gl_state.h>
+#include <gbuffer.h>
+#include <hiz_culler.h>
+#include <lights.h>
+#include <light_clusters.h>
+#include <instance_batch.h>
+#include <shader_variants.h>
+#include <shadow_atlas.h>
+#include <texture_cache.h>
+#include <uniform_buffer.h>
 
 #include <algorithm>
-#include <format>
 #include <random>
 #include <cmath>
 #include <cstdio>
@@ -44,20 +57,9 @@ GLFWwindow *createBorderlessWindow(const char *title) {
     return glfwCreateWindow(mode->width, mode->height, title, monitor, nullptr);
 }
 
-void createTexture(const char *path, GLuint &texture, GLint format) {
-    int texture_width, texture_height, channels;
-    unsigned char *texture_data =
-        stbi_load(path, &texture_width, &texture_height, &channels, 0);
-    if (!texture_data) {
-        stbi_image_free(texture_data);
-        exit(EXIT_FAILURE);
-    }
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture_width, texture_height, 0,
-                 format, GL_UNSIGNED_BYTE, texture_data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    stbi_image_free(texture_data);
+void createTexture(const char *path, GLuint &texture) {
+    texture = loadTexture(path);
+    if (!texture) exit(EXIT_FAILURE);
 }
 
 int width = 800;
@@ -69,6 +71,21 @@ float lastX = width / 2;
 float lastY = height / 2;
 bool firstMouse = true;
 
+// M switches model submission between multi-draw indirect and the sorted
+// render queue.
+bool indirectModels = true;
+// O cycles occlusion culling between off, Hi-Z on the GPU, which only
+// covers the multi-draw indirect models, and the software rasterizer.
+enum OcclusionMode { NO_OCCLUSION, HIZ_OCCLUSION, SOFTWARE_OCCLUSION };
+OcclusionMode occlusionMode = HIZ_OCCLUSION;
+// L cycles the number of small point lights wandering around the scene.
+const int wanderingLightCounts[] = {0, 1024, 4096, 10240};
+int wanderingLightIndex = 1;
+// F switches between forward and deferred shading.
+bool deferredShading = false;
+// H switches shadows on and off; the scene shaders compile them out.
+bool shadowsEnabled = true;
+
 glm::mat4 view = glm::mat4(1.0f);
 glm::mat4 projection = glm::perspective(glm::radians(camera.FOV),
                                         (float)width / height, 0.1f, 100.0f);
@@ -78,6 +95,29 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
         glfwSetWindowShouldClose(window, GLFW_TRUE);
     }
+    if (key == GLFW_KEY_M && action == GLFW_PRESS) {
+        indirectModels = !indirectModels;
+    }
+    if (key == GLFW_KEY_O && action == GLFW_PRESS) {
+        occlusionMode = OcclusionMode((occlusionMode + 1) % 3);
+    }
+    if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+        wanderingLightIndex = (wanderingLightIndex + 1) % 4;
+    }
+    if (key == GLFW_KEY_F && action == GLFW_PRESS) {
+        deferredShading = !deferredShading;
+    }
+    if (key == GLFW_KEY_H && action == GLFW_PRESS) {
+        shadowsEnabled = !shadowsEnabled;
+    }
+}
+
+// Left click picks the object under the crosshair.
+bool pickRequested = false;
+static void mouse_button_callback(GLFWwindow *window, int button, int action,
+                                  int mods) {
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+        pickRequested = true;
 }
 
 static void mouse_callback(GLFWwindow *window, double xpos, double ypos) {
@@ -128,7 +168,7 @@ static void framebuffer_callback(GLFWwindow *window, int newWidth,
 
 float lastFrameFPS;
 int frames = 0;
-static void printFPS() {
+static bool printFPS() {
     float current = glfwGetTime();
     float dt = current - lastFrameFPS;
     ++frames;
@@ -137,7 +177,9 @@ static void printFPS() {
         std::cout << fps << std::endl;
         frames = 0;
         lastFrameFPS = current;
+        return true;
     }
+    return false;
 }
 
 // clang-format off
@@ -219,7 +261,7 @@ int main(int argc, char **argv) {
     glfwSetErrorCallback(error_cb);
     if (!glfwInit()) exit(EXIT_FAILURE);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     stbi_set_flip_vertically_on_load(true);
 
@@ -234,6 +276,7 @@ int main(int argc, char **argv) {
     glfwSetKeyCallback(window, key_callback);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
     glfwMakeContextCurrent(window);
     glfwSwapInterval(1);
@@ -243,9 +286,10 @@ int main(int argc, char **argv) {
 
     glfwSetFramebufferSizeCallback(window, framebuffer_callback);
     glClearColor(0.05f, 0.08f, 0.1f, 1.0);
-    glEnable(GL_DEPTH_TEST);
+    GLState &state = GLState::instance();
+    state.enable(GL_DEPTH_TEST);
     glDepthFunc(GL_LESS);
-    glEnable(GL_CULL_FACE);
+    state.enable(GL_CULL_FACE);
     glCullFace(GL_FRONT);
     glFrontFace(GL_CW);
 
@@ -254,24 +298,32 @@ int main(int argc, char **argv) {
     std::cout << "Renderer: " << renderer << std::endl;
     std::cout << "OpenGL version supported: " << version << std::endl;
 
-    Shader shader("./shaders/vertex.vert", "./shaders/fragment.frag");
-    Shader lightShader("./shaders/vertex.vert", "./shaders/fragment2.frag");
+    // Scene shaders come in variants with the features a draw does not use
+    // compiled out. Every variant starts with these material uniforms.
+    auto materialSetup = [](Shader &shader) {
+        shader.set("material.diffuse", 0);
+        shader.set("material.specular", 1);
+        shader.set("material.shiny", 32.0f);
+    };
+    ShaderVariants cubeShaders("./shaders/instanced.vert",
+                               "./shaders/fragment.frag", lightingDefines(),
+                               materialSetup, lightingPrelude());
+    Shader lightShader("./shaders/instanced.vert", "./shaders/fragment2.frag");
 
     GLuint textureDiffuse;
-    createTexture("./textures/container.png", textureDiffuse, GL_RGBA);
+    createTexture("./textures/container.png", textureDiffuse);
     GLuint textureSpecular;
-    createTexture("./textures/container_specular.png", textureSpecular,
-                  GL_RGBA);
+    createTexture("./textures/container_specular.png", textureSpecular);
 
     GLuint vbo;
     glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    state.bindBuffer(GL_ARRAY_BUFFER, vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
     GLuint vao;
     glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    state.bindVertexArray(vao);
+    state.bindBuffer(GL_ARRAY_BUFFER, vbo);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), 0);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float),
                           (const void *)(3 * sizeof(float)));
@@ -283,76 +335,43 @@ int main(int argc, char **argv) {
 
     GLuint lightVAO;
     glGenVertexArrays(1, &lightVAO);
-    glBindVertexArray(lightVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    state.bindVertexArray(lightVAO);
+    state.bindBuffer(GL_ARRAY_BUFFER, vbo);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), 0);
     glEnableVertexAttribArray(0);
 
-    for (size_t i = 0; i < 10; i++) {
-        std::string propertyString = std::format("pointLights[{}].", i);
-        std::string strings[] = {
-            propertyString + "position",     propertyString + "ambient",
-            propertyString + "diffuse",      propertyString + "specular",
-            propertyString + "coefficients",
-        };
-        glProgramUniform3fv(shader.id,
-                            glGetUniformLocation(shader.id, strings[0].data()),
-                            1, &pointLightPositions[i][0]);
-        glProgramUniform3f(shader.id,
-                           glGetUniformLocation(shader.id, strings[1].data()),
-                           0.0f, 0.0f, 0.0f);
-        glProgramUniform3f(shader.id,
-                           glGetUniformLocation(shader.id, strings[2].data()),
-                           0.5f, 0.5f, 0.5f);
-        glProgramUniform3f(shader.id,
-                           glGetUniformLocation(shader.id, strings[3].data()),
-                           1.0f, 1.0f, 1.0f);
-        glProgramUniform3f(shader.id,
-                           glGetUniformLocation(shader.id, strings[4].data()),
-                           1.0f, 0.09f, 0.002f);
+    UniformBuffer<CameraBlock> cameraBuffer(CAMERA_BINDING);
+    UniformBuffer<LightsBlock> lightsBuffer(LIGHTS_BINDING);
+
+    LightsBlock lights{};
+    LightClusters lightClusters;
+    std::vector<PointLight> pointLights;
+    for (const glm::vec3 &position : pointLightPositions) {
+        PointLight light{};
+        light.position = position;
+        light.ambient = glm::vec3(0.0f);
+        light.diffuse = glm::vec3(0.5f);
+        light.specular = glm::vec3(1.0f);
+        light.coefficients = glm::vec3(1.0f, 0.09f, 0.002f);
+        pointLights.push_back(light);
     }
-
-    glProgramUniform3f(shader.id,
-                       glGetUniformLocation(shader.id, "directedLight.ambient"),
-                       0.05f, 0.05f, 0.05f);
-    glProgramUniform3f(shader.id,
-                       glGetUniformLocation(shader.id, "directedLight.diffuse"),
-                       0.4f, 0.4f, 0.4f);
-    glProgramUniform3f(
-        shader.id, glGetUniformLocation(shader.id, "directedLight.specular"),
-        0.5f, 0.5f, 0.5f);
-    glProgramUniform3f(
-        shader.id, glGetUniformLocation(shader.id, "directedLight.direction"),
-        -0.2f, -1.0f, -0.3f);
-
-    glProgramUniform3f(shader.id,
-                       glGetUniformLocation(shader.id, "spotLight.ambient"),
-                       0.0f, 0.0f, 0.0f);
-    glProgramUniform3f(shader.id,
-                       glGetUniformLocation(shader.id, "spotLight.diffuse"),
-                       0.5f, 0.5f, 0.5f);
-    glProgramUniform3f(shader.id,
-                       glGetUniformLocation(shader.id, "spotLight.specular"),
-                       1.0f, 1.0f, 1.0f);
-    glProgramUniform3f(
-        shader.id, glGetUniformLocation(shader.id, "spotLight.coefficients"),
-        1.0f, 0.09f, 0.002f);
-    glProgramUniform1f(shader.id,
-                       glGetUniformLocation(shader.id, "spotLight.cutoff"),
-                       cos(glm::radians(20.0f)));
-    glProgramUniform1f(shader.id,
-                       glGetUniformLocation(shader.id, "spotLight.outerCutoff"),
-                       cos(glm::radians(30.0f)));
-
-    glProgramUniform1i(shader.id,
-                       glGetUniformLocation(shader.id, "material.diffuse"), 0);
-    glProgramUniform1i(shader.id,
-                       glGetUniformLocation(shader.id, "material.specular"), 1);
-    glProgramUniform3f(shader.id,
-                       glGetUniformLocation(shader.id, "material.specular"),
-                       0.5f, 0.5f, 0.5f);
-    glProgramUniform1f(
-        shader.id, glGetUniformLocation(shader.id, "material.shiny"), 32.0f);
+    const size_t fixedLights = pointLights.size();
+    std::vector<glm::vec4> wanderingSeeds(wanderingLightCounts[3]);
+    for (glm::vec4 &seed : wanderingSeeds)
+        seed = glm::vec4(dist0_1(rng), dist0_1(rng), dist0_1(rng),
+                         dist0_1(rng));
+
+    lights.directedLight.ambient = glm::vec3(0.05f);
+    lights.directedLight.diffuse = glm::vec3(0.4f);
+    lights.directedLight.specular = glm::vec3(0.5f);
+    lights.directedLight.direction = glm::vec3(-0.2f, -1.0f, -0.3f);
+
+    lights.spotLight.ambient = glm::vec3(0.0f);
+    lights.spotLight.diffuse = glm::vec3(0.5f);
+    lights.spotLight.specular = glm::vec3(1.0f);
+    lights.spotLight.coefficients = glm::vec3(1.0f, 0.09f, 0.002f);
+    lights.spotLight.cutoff = cos(glm::radians(20.0f));
+    lights.spotLight.outerCutoff = cos(glm::radians(30.0f));
 
     float angles[10][3];
     for (size_t i = 0; i < 10; i++) {
@@ -365,6 +384,73 @@ int main(int argc, char **argv) {
         speeds[i] = dist0_10(rng) + 10;
     }
 
+    // Models given on the command line stream in while the scene renders.
+    // By default their meshes go out in a few multi-draw indirect calls.
+    // Each mesh is drawn with the variant its material needs.
+    ShaderVariants modelShaders("./shaders/indirect.vert",
+                                "./shaders/fragment.frag", lightingDefines(),
+                                materialSetup, lightingPrelude());
+    ShaderVariants queueShaders("./shaders/vertex.vert",
+                                "./shaders/fragment.frag", lightingDefines(),
+                                materialSetup, lightingPrelude());
+    // The same geometry goes into the G-buffer in deferred mode.
+    ShaderVariants cubeGBufferShaders("./shaders/instanced.vert",
+                                      "./shaders/gbuffer.frag", {},
+                                      materialSetup);
+    ShaderVariants modelGBufferShaders("./shaders/indirect.vert",
+                                       "./shaders/gbuffer.frag", {},
+                                       materialSetup);
+    ShaderVariants queueGBufferShaders("./shaders/vertex.vert",
+                                       "./shaders/gbuffer.frag", {},
+                                       materialSetup);
+    GBuffer gbuffer(width, height);
+    // The directed light casts cascaded shadows; casters are drawn depth
+    // only.
+    CascadedShadows shadows;
+    Shader cubeDepthShader("./shaders/instanced.vert", "./shaders/depth.frag");
+    Shader modelDepthShader("./shaders/indirect.vert", "./shaders/depth.frag");
+    InstanceBatch shadowCubes;
+    IndirectBatch shadowBatch;
+    std::vector<std::uint32_t> casters;
+    size_t shadowCasters = 0, shadowCascades = 0;
+    // The spot light and the fixed point lights cast shadows from an atlas
+    // whose tiles are redrawn only when something in them moved.
+    ShadowAtlas shadowAtlas;
+    size_t shadowTiles = 0;
+    IndirectBatch modelBatch;
+    // Models covering much of the screen are drawn into the Hi-Z depth
+    // pre-pass and hide the meshes behind them.
+    IndirectBatch occluderBatch;
+    HiZCuller occlusion(width, height);
+    // The cubes fill their bounds, so they are their own occluders. The
+    // rasterizer gets its own threads, as model loads can keep the loader
+    // pool busy for seconds.
+    ThreadPool occlusionPool;
+    SoftwareOcclusion softwareOcclusion(occlusionPool);
+    RenderQueue queue;
+    MeshOptimizer::enabled = true;
+    ThreadPool pool;
+    ModelLoader loader(pool);
+    std::vector<std::shared_ptr<ModelHandle>> models;
+    for (int i = 1; i < argc; i++) models.push_back(loader.load(argv[i]));
+
+    InstanceBatch lightBatch;
+    for (const glm::vec3 &position : pointLightPositions) {
+        lightBatch.add(glm::translate(glm::mat4(1.0f), position));
+    }
+    InstanceBatch cubeBatch;
+
+    // Every cube and loaded model is an object in the scene BVH. Cubes
+    // move every frame, so the tree is refit each frame and rebuilt only
+    // when a model finishes loading.
+    const Bounds cubeBounds = {glm::vec3(-0.5f), glm::vec3(0.5f)};
+    const Occluder cubeOccluder = Occluder::box(cubeBounds);
+    BVH scene;
+    std::vector<Bounds> sceneBounds;
+    std::vector<Model *> sceneModels;
+    std::vector<std::uint32_t> visible;
+    glm::mat4 lastCubeModels[10] = {};
+
     lastFrame = lastFrameFPS = glfwGetTime();
     while (!glfwWindowShouldClose(window)) {
         double time = glfwGetTime();
@@ -372,7 +458,32 @@ int main(int argc, char **argv) {
         const float currentFrame = time;
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
-        printFPS();
+        if (printFPS()) {
+            const GLState::Counters &calls = state.counters();
+            std::cout << calls.issued << " state calls issued, "
+                      << calls.filtered << " filtered, "
+                      << (indirectModels ? modelBatch.culled() : queue.culled())
+                      << " meshes culled" << std::endl;
+            if (indirectModels && occlusionMode == HIZ_OCCLUSION)
+                std::cout << modelBatch.occluded() << " meshes occluded"
+                          << std::endl;
+            if (!indirectModels) {
+                const RenderStats &stats = queue.stats();
+                std::cout << stats.draws << " draws, " << stats.programs
+                          << " programs, " << stats.vertexArrays
+                          << " vertex arrays, " << stats.textureSets
+                          << " texture sets" << std::endl;
+            }
+            std::vector<GLuint> counts = lightClusters.counts();
+            std::cout << lightClusters.size() << " point lights, up to "
+                      << *std::max_element(counts.begin(), counts.end())
+                      << " per cluster" << std::endl;
+            std::cout << shadowCasters << " shadow casters drawn into "
+                      << shadowCascades << " cascades and " << shadowTiles
+                      << " of " << shadowAtlas.count() << " atlas tiles"
+                      << std::endl;
+        }
+        state.resetCounters();
         processInput(window);
 
         // cubePositions[0] =
@@ -382,45 +493,43 @@ int main(int argc, char **argv) {
         //               lightSpeed)));
 
         view = camera.getViewMatrix();
-
-        glProgramUniformMatrix4fv(lightShader.id,
-                                  glGetUniformLocation(lightShader.id, "view"),
-                                  1, GL_FALSE, glm::value_ptr(view));
-        glProgramUniformMatrix4fv(
-            lightShader.id, glGetUniformLocation(lightShader.id, "projection"),
-            1, GL_FALSE, glm::value_ptr(projection));
-
-        glProgramUniformMatrix4fv(shader.id,
-                                  glGetUniformLocation(shader.id, "view"), 1,
-                                  GL_FALSE, glm::value_ptr(view));
-        glProgramUniformMatrix4fv(shader.id,
-                                  glGetUniformLocation(shader.id, "projection"),
-                                  1, GL_FALSE, glm::value_ptr(projection));
-        glProgramUniform3fv(
-            shader.id, glGetUniformLocation(shader.id, "spotLight.position"), 1,
-            &camera.position[0]);
-        glProgramUniform3fv(
-            shader.id, glGetUniformLocation(shader.id, "spotLight.direction"),
-            1, &camera.front[0]);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, textureDiffuse);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, textureSpecular);
-
-        lightShader.use();
-        glBindVertexArray(lightVAO);
-        for (size_t i = 0; i < 4; i++) {
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, pointLightPositions[i]);
-            model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));
-            glProgramUniformMatrix4fv(
-                lightShader.id, glGetUniformLocation(lightShader.id, "model"),
-                1, GL_FALSE, glm::value_ptr(model));
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+        glm::mat4 viewProjection = projection * view;
+        Frustum frustum = Frustum::fromMatrix(viewProjection);
+
+        lights.spotLight.position = camera.position;
+        lights.spotLight.direction = camera.front;
+
+        // The wandering lights keep the same density however many there
+        // are, so the area they cover grows with their number.
+        int wandering = wanderingLightCounts[wanderingLightIndex];
+        float field = 4.0f * std::sqrt(wandering / 64.0f);
+        pointLights.resize(fixedLights + wandering);
+        for (int i = 0; i < wandering; i++) {
+            const glm::vec4 &seed = wanderingSeeds[i];
+            float angle = seed.w * glm::two_pi<float>() +
+                          (float)time * (0.5f + seed.x);
+            glm::vec3 anchor((seed.x * 2.0f - 1.0f) * field,
+                             seed.y * 10.0f - 5.0f,
+                             (seed.z * 2.0f - 1.0f) * field - 6.0f);
+            glm::vec3 color = glm::normalize(glm::vec3(seed) + 0.2f);
+            PointLight &light = pointLights[fixedLights + i];
+            light.position = anchor + glm::vec3(cos(angle),
+                                                0.25f * sin(2.0f * angle),
+                                                sin(angle));
+            light.ambient = glm::vec3(0.0f);
+            light.diffuse = color * 0.8f;
+            light.specular = color * 0.4f;
+            light.coefficients = glm::vec3(1.0f, 2.0f, 40.0f);
         }
-
-        shader.use();
-        glBindVertexArray(vao);
+        ShaderVariants::setCommon("SHADOWS", shadowsEnabled);
+        if (shadowsEnabled)
+            shadowAtlas.update(view, projection, height, pointLights,
+                               fixedLights, lights.spotLight);
+        lightClusters.update(pointLights);
+        lightClusters.assign(view, projection, width, height, lights);
+
+        glm::mat4 cubeModels[10];
+        sceneBounds.clear();
         for (size_t i = 0; i < 10; ++i) {
             glm::mat4 model = glm::mat4(1.0f);
             model = glm::translate(model, cubePositions[i]);
@@ -428,21 +537,161 @@ int main(int argc, char **argv) {
                 model, (float)time * glm::radians(speeds[i]),
                 glm::vec3(angles[i][0], angles[i][1], angles[i][2]));
             model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));
-            glProgramUniformMatrix4fv(shader.id,
-                                      glGetUniformLocation(shader.id, "model"),
-                                      1, GL_FALSE, glm::value_ptr(model));
-            glm::mat3 normalModel =
-                glm::mat3(glm::transpose(glm::inverse(model)));
-            glProgramUniformMatrix3fv(
-                shader.id, glGetUniformLocation(shader.id, "normalModel"), 1,
-                GL_FALSE, glm::value_ptr(normalModel));
-            glProgramUniform3fv(shader.id,
-                                glGetUniformLocation(shader.id, "viewPos"), 1,
-                                &camera.position[0]);
-
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+            cubeModels[i] = model;
+            sceneBounds.push_back(transformBounds(cubeBounds, model));
+            // A turning cube leaves and enters shadow atlas tiles, which
+            // then need redrawing.
+            if (model != lastCubeModels[i]) {
+                shadowAtlas.invalidate(
+                    transformBounds(cubeBounds, lastCubeModels[i]));
+                shadowAtlas.invalidate(sceneBounds.back());
+                lastCubeModels[i] = model;
+            }
+        }
+
+        loader.update();
+        // Textures whose last model went away are deleted here, on the GL
+        // thread.
+        TextureCache::instance().purge();
+        sceneModels.clear();
+        for (auto &model : models) {
+            if (!model->ready()) continue;
+            sceneModels.push_back(&model->model());
+            sceneBounds.push_back(model->model().bounds());
+        }
+        if (sceneBounds.size() != scene.size()) {
+            scene.build(sceneBounds);
+            shadowAtlas.invalidate();
+        } else
+            scene.refit(sceneBounds);
+        scene.query(frustum, visible);
+
+        // Each due cascade or atlas tile draws only the casters the BVH
+        // finds in its volume. The shadow passes borrow the camera block, so
+        // the camera is uploaded after them.
+        auto gatherCasters = [&](const Frustum &casterFrustum) {
+            scene.query(casterFrustum, casters);
+            shadowCubes.clear();
+            shadowBatch.clear();
+            for (std::uint32_t object : casters) {
+                if (object < 10)
+                    shadowCubes.add(cubeModels[object]);
+                else
+                    sceneModels[object - 10]->queue(shadowBatch);
+            }
+            shadowBatch.cull(casterFrustum);
+            shadowCasters += shadowCubes.size() + shadowBatch.size();
+        };
+        auto drawCasters = [&] {
+            cubeDepthShader.use();
+            shadowCubes.drawArrays(vao, 0, 36);
+            shadowBatch.draw(modelDepthShader);
+        };
+        shadowCasters = shadowCascades = shadowTiles = 0;
+        if (shadowsEnabled) {
+            shadows.update(view, projection, lights.directedLight.direction);
+            for (int cascade = 0; cascade < shadows.count(); cascade++) {
+                if (!shadows.due(cascade)) continue;
+                gatherCasters(shadows.casterFrustum(cascade));
+                shadows.render(cascade, cameraBuffer, drawCasters);
+                shadowCascades++;
+            }
+            shadows.apply(lights);
+            for (int tile = 0; tile < shadowAtlas.count(); tile++) {
+                if (!shadowAtlas.due(tile)) continue;
+                gatherCasters(shadowAtlas.casterFrustum(tile));
+                shadowAtlas.render(tile, cameraBuffer, drawCasters);
+                shadowTiles++;
+            }
+            shadowAtlas.apply();
+        }
+        cameraBuffer.update({view, projection, camera.position});
+        lightsBuffer.update(lights);
+
+        state.bindTexture(0, GL_TEXTURE_2D, textureDiffuse);
+        state.bindTexture(1, GL_TEXTURE_2D, textureSpecular);
+
+        if (pickRequested) {
+            pickRequested = false;
+            RayHit hit;
+            if (!scene.raycast({camera.position, camera.front}, hit))
+                std::cout << "Picked nothing" << std::endl;
+            else if (hit.object < 10)
+                std::cout << "Picked cube " << hit.object << std::endl;
+            else
+                std::cout << "Picked model " << hit.object - 10 << " at "
+                          << hit.distance << std::endl;
         }
 
+        if (occlusionMode == SOFTWARE_OCCLUSION) {
+            softwareOcclusion.begin(viewProjection);
+            for (std::uint32_t object : visible)
+                if (object < 10)
+                    softwareOcclusion.add(cubeOccluder, cubeModels[object]);
+            softwareOcclusion.render();
+        }
+
+        if (deferredShading) {
+            gbuffer.resize(width, height);
+            // Without a usable G-buffer, stay with forward shading.
+            deferredShading = gbuffer.complete();
+            if (deferredShading) gbuffer.begin();
+        }
+        ShaderVariants &cubeVariants =
+            deferredShading ? cubeGBufferShaders : cubeShaders;
+        ShaderVariants &modelBatchVariants =
+            deferredShading ? modelGBufferShaders : modelShaders;
+        ShaderVariants &modelQueueVariants =
+            deferredShading ? queueGBufferShaders : queueShaders;
+
+        cubeBatch.clear();
+        modelBatch.clear();
+        occluderBatch.clear();
+        queue.begin(camera.position);
+        for (std::uint32_t object : visible) {
+            if (object < 10) {
+                if (occlusionMode != SOFTWARE_OCCLUSION ||
+                    softwareOcclusion.visible(sceneBounds[object]))
+                    cubeBatch.add(cubeModels[object]);
+            } else if (indirectModels) {
+                sceneModels[object - 10]->queue(modelBatch);
+                if (occlusionMode == HIZ_OCCLUSION &&
+                    HiZCuller::isOccluder(sceneBounds[object], viewProjection))
+                    sceneModels[object - 10]->queue(occluderBatch);
+            } else {
+                sceneModels[object - 10]->queue(queue, modelQueueVariants);
+            }
+        }
+        cubeVariants.get().use();
+        cubeBatch.drawArrays(vao, 0, 36);
+
+        if (indirectModels) {
+            modelBatch.cull(frustum);
+            if (occlusionMode == SOFTWARE_OCCLUSION)
+                modelBatch.cull(softwareOcclusion);
+            if (occlusionMode == HIZ_OCCLUSION) {
+                occlusion.resize(width, height);
+                occlusion.build(occluderBatch);
+                modelBatch.prepare();
+                occlusion.cull(modelBatch, viewProjection);
+            } else {
+                modelBatch.prepare();
+            }
+            modelBatch.submit(modelBatchVariants);
+        } else {
+            queue.cull(frustum);
+            if (occlusionMode == SOFTWARE_OCCLUSION)
+                queue.cull(softwareOcclusion);
+            queue.flush();
+        }
+
+        if (deferredShading) {
+            gbuffer.end();
+            gbuffer.light(viewProjection);
+        }
+        lightShader.use();
+        lightBatch.drawArrays(lightVAO, 0, 36);
+
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
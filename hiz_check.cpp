@@ -0,0 +1,129 @@
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <camera.h>
+#include <hiz_culler.h>
+#include <indirect_batch.h>
+#include <mesh.h>
+#include <offscreen_context.h>
+#include <uniform_buffer.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// Headless check of HiZCuller, meant for Mesa's llvmpipe with no display.
+// A wall is drawn as the only occluder, then cubes behind it, beside it,
+// past its edge and in front of it are culled against the pyramid, and
+// the instance counts left in the batch's command buffer must match what
+// the camera can see. Links against EGL; run it from the repository root.
+//
+//   hiz_check
+
+// A unit cube around the origin, one quad per face.
+Mesh makeCube() {
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    for (int axis = 0; axis < 3; axis++) {
+        for (float sign : {-1.0f, 1.0f}) {
+            glm::vec3 normal(0.0f), u(0.0f), v(0.0f);
+            normal[axis] = sign;
+            u[(axis + 1) % 3] = 0.5f;
+            v[(axis + 2) % 3] = 0.5f * sign;
+            unsigned int first = vertices.size();
+            for (int corner = 0; corner < 4; corner++) {
+                glm::vec2 uv(corner & 1, corner >> 1);
+                glm::vec3 position = normal * 0.5f + u * (uv.x * 2 - 1) +
+                                     v * (uv.y * 2 - 1);
+                vertices.push_back({position, normal, uv});
+            }
+            for (unsigned int index : {0, 1, 3, 0, 3, 2})
+                indices.push_back(first + index);
+        }
+    }
+    return Mesh(vertices, indices, {});
+}
+
+struct Case {
+    const char *name;
+    glm::mat4 model;
+    bool visible;
+};
+
+glm::mat4 place(glm::vec3 position, glm::vec3 scale) {
+    return glm::scale(glm::translate(glm::mat4(1.0f), position), scale);
+}
+
+int main() {
+    const int width = 256, height = 256;
+    OffscreenContext context;
+    if (!context.ready()) return EXIT_FAILURE;
+    std::printf("%s\n",
+                reinterpret_cast<const char *>(glGetString(GL_RENDERER)));
+    Shader::binaryCacheDirectory.clear();
+
+    glm::vec3 eye(0.0f, 0.0f, 5.0f);
+    CameraBlock camera;
+    camera.view =
+        glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    camera.projection = glm::perspective(glm::radians(45.0f),
+                                         float(width) / height, 0.1f, 100.0f);
+    camera.viewPos = eye;
+    UniformBuffer<CameraBlock> cameraBuffer(CAMERA_BINDING);
+    cameraBuffer.update(camera);
+    glm::mat4 viewProjection = camera.projection * camera.view;
+
+    Mesh cube = makeCube();
+    glm::mat4 wall = place(glm::vec3(0.0f, 0.0f, 2.0f),
+                           glm::vec3(2.0f, 2.0f, 0.2f));
+    // The wall's silhouette reaches x = 2.75 at the depth of the cubes.
+    std::vector<Case> cases = {
+        {"wall", wall, true},
+        {"behind", place(glm::vec3(0.5f, 0.5f, -3.0f), glm::vec3(0.5f)),
+         false},
+        {"behind", place(glm::vec3(-0.5f, -0.5f, -3.0f), glm::vec3(0.5f)),
+         false},
+        {"beside", place(glm::vec3(3.5f, 0.0f, -3.0f), glm::vec3(1.0f)),
+         true},
+        {"edge", place(glm::vec3(2.75f, 0.0f, -3.0f), glm::vec3(1.0f)),
+         true},
+        {"front", place(glm::vec3(0.3f, 0.0f, 3.5f), glm::vec3(0.2f)),
+         true},
+    };
+
+    HiZCuller culler(width, height);
+    IndirectBatch occluders, batch;
+    if (!HiZCuller::isOccluder(transformBounds(cube.bounds, wall),
+                               viewProjection)) {
+        std::cerr << "ERROR WALL TOO SMALL TO OCCLUDE" << std::endl;
+        return EXIT_FAILURE;
+    }
+    occluders.add(cube, wall);
+    for (const Case &c : cases) batch.add(cube, c.model);
+    culler.build(occluders);
+    batch.prepare();
+    culler.cull(batch, viewProjection);
+
+    // All draws share a material, so prepare() keeps them in order.
+    std::vector<DrawElementsIndirectCommand> commands(batch.size());
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    GLState::instance().bindBuffer(GL_DRAW_INDIRECT_BUFFER,
+                                   batch.getCommandBuffer());
+    glGetBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0,
+                       commands.size() * sizeof(DrawElementsIndirectCommand),
+                       commands.data());
+
+    bool passed = glGetError() == GL_NO_ERROR;
+    if (!passed) std::cerr << "ERROR GL ERROR DURING CULLING" << std::endl;
+    for (size_t i = 0; i < cases.size(); i++) {
+        bool visible = commands[i].instanceCount != 0;
+        bool ok = visible == cases[i].visible;
+        std::printf("%-7s %-8s %s\n", cases[i].name,
+                    visible ? "visible" : "culled", ok ? "ok" : "WRONG");
+        passed = passed && ok;
+    }
+    cube.release();
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
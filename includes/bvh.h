@@ -0,0 +1,341 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/glm.hpp>
+
+#include <frustum.h>
+#include <vertex_format.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+};
+
+struct RayHit {
+    std::uint32_t object;
+    float distance;
+};
+
+// Bounding volume hierarchy over the world bounds of scene objects, which
+// are identified by their index in the vector passed to build(). Moving
+// objects are handled with refit(), which keeps the tree shape; rebuild
+// when objects are added or removed or the tree degrades.
+class BVH {
+   public:
+    static constexpr int BINS = 16;
+    static constexpr std::uint32_t MAX_LEAF_SIZE = 4;
+
+    // Nodes are stored depth first: the left child directly follows its
+    // parent and the right child is at index first. Leaves own
+    // objects[first, first + count).
+    struct Node {
+        Bounds bounds;
+        std::uint32_t first;
+        std::uint32_t count;
+
+        bool leaf() const { return count > 0; }
+    };
+
+    void build(const std::vector<Bounds> &bounds) {
+        objectBounds = bounds;
+        nodes.clear();
+        objects.resize(bounds.size());
+        for (std::uint32_t i = 0; i < objects.size(); i++) objects[i] = i;
+        if (objects.empty()) return;
+        nodes.reserve(objects.size() * 2);
+        centroids.resize(bounds.size());
+        for (size_t i = 0; i < bounds.size(); i++)
+            centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+        split(0, objects.size());
+    }
+
+    // Move object to new bounds; takes effect on the next refit().
+    void update(std::uint32_t object, const Bounds &bounds) {
+        objectBounds[object] = bounds;
+    }
+    void refit(const std::vector<Bounds> &bounds) {
+        objectBounds = bounds;
+        refit();
+    }
+    // Children follow their parents, so one reverse sweep suffices.
+    void refit() {
+        for (size_t i = nodes.size(); i-- > 0;) {
+            Node &node = nodes[i];
+            if (node.leaf()) {
+                node.bounds = objectBounds[objects[node.first]];
+                for (std::uint32_t j = 1; j < node.count; j++)
+                    node.bounds = merge(node.bounds,
+                                        objectBounds[objects[node.first + j]]);
+            } else {
+                node.bounds = merge(nodes[i + 1].bounds,
+                                    nodes[node.first].bounds);
+            }
+        }
+    }
+
+    size_t size() const { return objectBounds.size(); }
+    const std::vector<Node> &getNodes() const { return nodes; }
+
+    // Objects whose bounds intersect the frustum. Subtrees entirely inside
+    // are taken without testing their objects.
+    void query(const Frustum &frustum,
+               std::vector<std::uint32_t> &result) const {
+        result.clear();
+        if (nodes.empty()) return;
+        std::vector<std::uint32_t> stack = {0};
+        while (!stack.empty()) {
+            std::uint32_t index = stack.back();
+            stack.pop_back();
+            const Node &node = nodes[index];
+            int side = classify(frustum, node.bounds);
+            if (side < 0) continue;
+            if (side > 0) {
+                collect(index, result);
+            } else if (node.leaf()) {
+                for (std::uint32_t j = 0; j < node.count; j++) {
+                    std::uint32_t object = objects[node.first + j];
+                    if (classify(frustum, objectBounds[object]) >= 0)
+                        result.push_back(object);
+                }
+            } else {
+                stack.push_back(node.first);
+                stack.push_back(index + 1);
+            }
+        }
+    }
+
+    // Objects whose bounds overlap bounds.
+    void query(const Bounds &bounds,
+               std::vector<std::uint32_t> &result) const {
+        result.clear();
+        if (nodes.empty()) return;
+        std::vector<std::uint32_t> stack = {0};
+        while (!stack.empty()) {
+            std::uint32_t index = stack.back();
+            stack.pop_back();
+            const Node &node = nodes[index];
+            if (!overlaps(node.bounds, bounds)) continue;
+            if (node.leaf()) {
+                for (std::uint32_t j = 0; j < node.count; j++) {
+                    std::uint32_t object = objects[node.first + j];
+                    if (overlaps(objectBounds[object], bounds))
+                        result.push_back(object);
+                }
+            } else {
+                stack.push_back(node.first);
+                stack.push_back(index + 1);
+            }
+        }
+    }
+
+    // Closest object whose bounds the ray enters within maxDistance.
+    bool raycast(const Ray &ray, RayHit &hit,
+                 float maxDistance =
+                     std::numeric_limits<float>::infinity()) const {
+        if (nodes.empty()) return false;
+        glm::vec3 inverse = 1.0f / ray.direction;
+        hit = {0, maxDistance};
+        bool found = false;
+        std::vector<std::uint32_t> stack = {0};
+        while (!stack.empty()) {
+            std::uint32_t index = stack.back();
+            stack.pop_back();
+            const Node &node = nodes[index];
+            float distance;
+            if (!intersect(ray, inverse, node.bounds, distance) ||
+                distance > hit.distance)
+                continue;
+            if (node.leaf()) {
+                for (std::uint32_t j = 0; j < node.count; j++) {
+                    std::uint32_t object = objects[node.first + j];
+                    if (intersect(ray, inverse, objectBounds[object],
+                                  distance) &&
+                        distance <= hit.distance) {
+                        hit = {object, distance};
+                        found = true;
+                    }
+                }
+                continue;
+            }
+            // Visit the nearer child first so the farther one can be
+            // pruned by the hit it finds.
+            std::uint32_t closer = index + 1, farther = node.first;
+            float closerDistance, fartherDistance;
+            bool closerHit = intersect(ray, inverse, nodes[closer].bounds,
+                                       closerDistance);
+            bool fartherHit = intersect(ray, inverse, nodes[farther].bounds,
+                                        fartherDistance);
+            if (closerHit && fartherHit && fartherDistance < closerDistance) {
+                std::swap(closer, farther);
+                std::swap(closerHit, fartherHit);
+            }
+            if (fartherHit) stack.push_back(farther);
+            if (closerHit) stack.push_back(closer);
+        }
+        return found;
+    }
+
+    static Bounds merge(const Bounds &a, const Bounds &b) {
+        return {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+    }
+    static bool overlaps(const Bounds &a, const Bounds &b) {
+        return glm::all(glm::lessThanEqual(a.min, b.max)) &&
+               glm::all(glm::lessThanEqual(b.min, a.max));
+    }
+    // Slab test; distance is where the ray enters, 0 when it starts inside.
+    static bool intersect(const Ray &ray, const glm::vec3 &inverse,
+                          const Bounds &bounds, float &distance) {
+        glm::vec3 t0 = (bounds.min - ray.origin) * inverse;
+        glm::vec3 t1 = (bounds.max - ray.origin) * inverse;
+        glm::vec3 entries = glm::min(t0, t1), exits = glm::max(t0, t1);
+        float enter = glm::max(glm::max(entries.x, entries.y),
+                               glm::max(entries.z, 0.0f));
+        float leave = glm::min(exits.x, glm::min(exits.y, exits.z));
+        distance = enter;
+        return enter <= leave;
+    }
+    // -1 outside, 0 intersecting, 1 inside.
+    static int classify(const Frustum &frustum, const Bounds &bounds) {
+        glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+        glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+        int result = 1;
+        for (const glm::vec4 &plane : frustum.planes) {
+            glm::vec3 normal(plane);
+            float d = glm::dot(normal, center) + plane.w;
+            float r = glm::dot(glm::abs(normal), extent);
+            if (d < -r) return -1;
+            if (d < r) result = 0;
+        }
+        return result;
+    }
+
+   private:
+    std::vector<Node> nodes;
+    std::vector<std::uint32_t> objects;
+    std::vector<Bounds> objectBounds;
+    std::vector<glm::vec3> centroids;
+
+    static float area(const Bounds &bounds) {
+        glm::vec3 d = glm::max(bounds.max - bounds.min, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // A subtree owns the objects from its leftmost to its rightmost leaf.
+    void collect(std::uint32_t index,
+                 std::vector<std::uint32_t> &result) const {
+        std::uint32_t first = index, last = index;
+        while (!nodes[first].leaf()) first++;
+        while (!nodes[last].leaf()) last = nodes[last].first;
+        result.insert(result.end(), objects.begin() + nodes[first].first,
+                      objects.begin() + nodes[last].first + nodes[last].count);
+    }
+
+    // Binned SAH split of objects[begin, end) into a new node.
+    std::uint32_t split(std::uint32_t begin, std::uint32_t end) {
+        std::uint32_t index = nodes.size();
+        nodes.push_back({});
+        Bounds bounds = objectBounds[objects[begin]];
+        Bounds centroidBounds = {centroids[objects[begin]],
+                                 centroids[objects[begin]]};
+        for (std::uint32_t i = begin + 1; i < end; i++) {
+            bounds = merge(bounds, objectBounds[objects[i]]);
+            centroidBounds.min = glm::min(centroidBounds.min,
+                                          centroids[objects[i]]);
+            centroidBounds.max = glm::max(centroidBounds.max,
+                                          centroids[objects[i]]);
+        }
+        std::uint32_t count = end - begin;
+        nodes[index] = {bounds, begin, count};
+        if (count <= MAX_LEAF_SIZE) return index;
+
+        int bestAxis = -1, bestBin = 0;
+        float bestCost = area(bounds) * count;
+        glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+        for (int axis = 0; axis < 3; axis++) {
+            if (extent[axis] <= 0.0f) continue;
+            float scale = BINS / extent[axis];
+            Bounds binBounds[BINS];
+            std::uint32_t binCounts[BINS] = {};
+            for (std::uint32_t i = begin; i < end; i++) {
+                int bin = binOf(objects[i], axis, centroidBounds.min, scale);
+                const Bounds &object = objectBounds[objects[i]];
+                binBounds[bin] =
+                    binCounts[bin]++ ? merge(binBounds[bin], object) : object;
+            }
+            // Sweep from the right, then evaluate each split from the left.
+            float rightArea[BINS];
+            std::uint32_t rightCount[BINS];
+            Bounds right;
+            std::uint32_t total = 0;
+            for (int bin = BINS - 1; bin > 0; bin--) {
+                if (binCounts[bin])
+                    right = total ? merge(right, binBounds[bin])
+                                  : binBounds[bin];
+                total += binCounts[bin];
+                rightArea[bin] = total ? area(right) : 0.0f;
+                rightCount[bin] = total;
+            }
+            Bounds left;
+            total = 0;
+            for (int bin = 0; bin < BINS - 1; bin++) {
+                if (binCounts[bin])
+                    left = total ? merge(left, binBounds[bin])
+                                 : binBounds[bin];
+                total += binCounts[bin];
+                if (total == 0 || rightCount[bin + 1] == 0) continue;
+                float cost = area(left) * total +
+                             rightArea[bin + 1] * rightCount[bin + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = bin;
+                }
+            }
+        }
+
+        std::uint32_t middle;
+        if (bestAxis >= 0) {
+            float scale = BINS / extent[bestAxis];
+            middle = std::partition(objects.begin() + begin,
+                                    objects.begin() + end,
+                                    [&](std::uint32_t object) {
+                                        return binOf(object, bestAxis,
+                                                     centroidBounds.min,
+                                                     scale) <= bestBin;
+                                    }) -
+                     objects.begin();
+        } else {
+            // No split beats a leaf, or all centroids coincide. Large
+            // leaves hurt queries more than a poor split, so halve them
+            // along the widest axis.
+            if (count <= MAX_LEAF_SIZE * 4) return index;
+            int axis = extent.x >= extent.y && extent.x >= extent.z ? 0
+                       : extent.y >= extent.z                      ? 1
+                                                                   : 2;
+            middle = begin + count / 2;
+            std::nth_element(objects.begin() + begin, objects.begin() + middle,
+                             objects.begin() + end,
+                             [&](std::uint32_t a, std::uint32_t b) {
+                                 return centroids[a][axis] <
+                                        centroids[b][axis];
+                             });
+        }
+        nodes[index].count = 0;
+        split(begin, middle);
+        nodes[index].first = split(middle, end);
+        return index;
+    }
+
+    int binOf(std::uint32_t object, int axis, const glm::vec3 &min,
+              float scale) const {
+        int bin = int((centroids[object][axis] - min[axis]) * scale);
+        return std::clamp(bin, 0, BINS - 1);
+    }
+};
+
+#endif
@@ -5,6 +5,13 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+// Mirrors the std140 "Camera" block shared by every shader.
+struct CameraBlock {
+    glm::mat4 view;
+    glm::mat4 projection;
+    alignas(16) glm::vec3 viewPos;
+};
+
 enum cameraDirection {
     FORWARD,
     BACKWARD,
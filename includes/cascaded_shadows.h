@@ -0,0 +1,243 @@
+#ifndef CASCADED_SHADOWS_H
+#define CASCADED_SHADOWS_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <camera.h>
+#include <frustum.h>
+#include <gl_state.h>
+#include <lights.h>
+#include <uniform_buffer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// Cascaded shadow maps for the directed light. The view range up to
+// distance is split into slices, each covered by an orthographic shadow
+// map fit to the bounding sphere of the slice and snapped to whole texels,
+// so shadows hold still as the camera turns and moves. Per frame:
+//
+//     shadows.update(view, projection, lightDirection);
+//     for each cascade that is due():
+//         draw the casters inside casterFrustum(cascade) in render()
+//     shadows.apply(lights);
+class CascadedShadows {
+   public:
+    // Shadows end this far from the camera.
+    static inline float distance = 60.0f;
+    // Blend of logarithmic (1) and uniform (0) split depths.
+    static inline float splitLambda = 0.8f;
+    // Cascades from firstCached on are redrawn only every refreshInterval
+    // frames, staggered so they rarely fall due together. Their casters
+    // may lag by that many frames.
+    static inline int firstCached = 2;
+    static inline int refreshInterval = 4;
+    // Slope scaled and constant depth bias of the shadow casters.
+    static inline float slopeBias = 2.0f;
+    static inline float constantBias = 4.0f;
+
+    CascadedShadows(int cascades = MAX_CASCADES, int resolution = 2048) {
+        glGenFramebuffers(1, &framebuffer);
+        configure(cascades, resolution);
+    }
+    ~CascadedShadows() {
+        GLState &state = GLState::instance();
+        state.deleteFramebuffer(framebuffer);
+        state.deleteTexture(texture);
+    }
+    CascadedShadows(const CascadedShadows &) = delete;
+    CascadedShadows &operator=(const CascadedShadows &) = delete;
+
+    // Use cascades shadow maps of resolution x resolution texels. Every
+    // cascade falls due again.
+    void configure(int cascades, int resolution) {
+        this->cascades = std::clamp(cascades, 1, MAX_CASCADES);
+        this->resolution = std::max(resolution, 1);
+        for (Cascade &cascade : cascadeData) cascade = {};
+
+        GLState &state = GLState::instance();
+        if (texture) state.deleteTexture(texture);
+        glGenTextures(1, &texture);
+        state.bindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT32F,
+                       this->resolution, this->resolution, this->cascades);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S,
+                        GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T,
+                        GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE,
+                        GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC,
+                        GL_LEQUAL);
+
+        GLint previous;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        state.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture,
+                                  0, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+            GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR SHADOW FRAMEBUFFER INCOMPLETE" << std::endl;
+        state.bindFramebuffer(GL_FRAMEBUFFER, previous);
+    }
+
+    // Fit the cascades to the camera and pick the ones to redraw this
+    // frame. The projection must be a perspective one.
+    void update(const glm::mat4 &view, const glm::mat4 &projection,
+                const glm::vec3 &lightDirection) {
+        frame++;
+        glm::vec3 direction = glm::normalize(lightDirection);
+        bool turned = direction != this->direction;
+        this->direction = direction;
+        glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(1, 0, 0)
+                                                     : glm::vec3(0, 1, 0);
+        glm::mat4 rotation = glm::lookAt(glm::vec3(0.0f), direction, up);
+        glm::mat4 inverseView = glm::inverse(view);
+
+        float zNear = projection[3][2] / (projection[2][2] - 1.0f);
+        float zFar = projection[3][2] / (projection[2][2] + 1.0f);
+        float end = std::min(distance, zFar);
+        // Squared distance from the view axis to a frustum corner, per
+        // unit of depth.
+        float diagonal = 1.0f / (projection[0][0] * projection[0][0]) +
+                         1.0f / (projection[1][1] * projection[1][1]);
+
+        float sliceNear = zNear;
+        for (int i = 0; i < cascades; i++) {
+            float t = float(i + 1) / cascades;
+            float sliceFar =
+                splitLambda * zNear * std::pow(end / zNear, t) +
+                (1.0f - splitLambda) * (zNear + (end - zNear) * t);
+
+            // The smallest sphere around the slice is centred on the view
+            // axis; its radius only depends on the projection, so it is
+            // rounded up once against float noise.
+            float a = sliceNear * sliceNear * diagonal;
+            float b = sliceFar * sliceFar * diagonal;
+            float depth = std::clamp(
+                (sliceFar * sliceFar + b - sliceNear * sliceNear - a) /
+                    (2.0f * (sliceFar - sliceNear)),
+                sliceNear, sliceFar);
+            float radius = std::sqrt(
+                std::max((depth - sliceNear) * (depth - sliceNear) + a,
+                         (sliceFar - depth) * (sliceFar - depth) + b));
+            radius = std::ceil(radius * 16.0f) / 16.0f;
+            glm::vec3 center(inverseView * glm::vec4(0.0f, 0.0f, -depth, 1.0f));
+
+            // Move the map in whole texels only.
+            float texel = 2.0f * radius / resolution;
+            glm::vec3 lightCenter(rotation * glm::vec4(center, 1.0f));
+            lightCenter.x = std::floor(lightCenter.x / texel) * texel;
+            lightCenter.y = std::floor(lightCenter.y / texel) * texel;
+
+            Cascade &fitted = fittedData[i];
+            fitted.view = rotation;
+            fitted.projection = glm::ortho(
+                lightCenter.x - radius, lightCenter.x + radius,
+                lightCenter.y - radius, lightCenter.y + radius,
+                -lightCenter.z - radius, -lightCenter.z + radius);
+            fitted.split = sliceFar;
+            fitted.texel = texel;
+            fitted.valid = true;
+            cascadeData[i].split = sliceFar;
+
+            dueCascades[i] = turned || !cascadeData[i].valid ||
+                             i < firstCached || refreshInterval <= 1 ||
+                             (frame + i) % refreshInterval == 0;
+            sliceNear = sliceFar;
+        }
+    }
+
+    int count() const { return cascades; }
+    bool due(int cascade) const { return dueCascades[cascade]; }
+
+    // The cascade's box stretched towards the light without bound. Casters
+    // in front of the box still shadow it; depth clamping flattens them
+    // onto its near plane.
+    Frustum casterFrustum(int cascade) const {
+        const Cascade &fitted = fittedData[cascade];
+        Frustum frustum =
+            Frustum::fromMatrix(fitted.projection * fitted.view);
+        frustum.planes[4] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        return frustum;
+    }
+
+    // Redraw a due cascade. draw() runs with the cascade's light view and
+    // projection in camera, so any depth-only shader reading the Camera
+    // block draws the casters; update camera again afterwards.
+    template <typename Draw>
+    void render(int cascade, UniformBuffer<CameraBlock> &camera, Draw &&draw) {
+        GLState &state = GLState::instance();
+        GLint viewport[4], previous;
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        state.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture,
+                                  0, cascade);
+        glViewport(0, 0, resolution, resolution);
+        state.enable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        state.enable(GL_DEPTH_CLAMP);
+        state.enable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(slopeBias, constantBias);
+
+        const Cascade &fitted = fittedData[cascade];
+        camera.update({fitted.view, fitted.projection, -direction});
+        draw();
+
+        state.disable(GL_POLYGON_OFFSET_FILL);
+        state.disable(GL_DEPTH_CLAMP);
+        state.bindFramebuffer(GL_FRAMEBUFFER, previous);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        cascadeData[cascade] = fitted;
+    }
+
+    // Fill in the cascade fields of lights and bind the shadow maps. Each
+    // cascade uses the matrices it was last drawn with.
+    void apply(LightsBlock &lights) const {
+        // From clip space to texture coordinates and depth.
+        const glm::mat4 bias =
+            glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) *
+            glm::scale(glm::mat4(1.0f), glm::vec3(0.5f));
+        for (int i = 0; i < MAX_CASCADES; i++) {
+            const Cascade &cascade = cascadeData[i];
+            bool used = i < cascades && cascade.valid;
+            lights.cascadeMatrices[i] =
+                used ? bias * cascade.projection * cascade.view
+                     : glm::mat4(1.0f);
+            lights.cascadeSplits[i] = used ? cascade.split : 0.0f;
+            lights.cascadeTexels[i] = used ? cascade.texel : 0.0f;
+        }
+        GLState::instance().bindTexture(SHADOW_MAP_UNIT, GL_TEXTURE_2D_ARRAY,
+                                        texture);
+    }
+
+    GLuint getTexture() const { return texture; }
+
+   private:
+    struct Cascade {
+        glm::mat4 view = glm::mat4(1.0f);
+        glm::mat4 projection = glm::mat4(1.0f);
+        float split = 0.0f;
+        float texel = 0.0f;
+        bool valid = false;
+    };
+
+    GLuint framebuffer = 0, texture = 0;
+    int cascades = 0, resolution = 0;
+    unsigned int frame = 0;
+    glm::vec3 direction = glm::vec3(0.0f);
+    // What each layer holds, and this frame's fit.
+    Cascade cascadeData[MAX_CASCADES], fittedData[MAX_CASCADES];
+    bool dueCascades[MAX_CASCADES] = {};
+};
+
+#endif
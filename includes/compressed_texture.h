@@ -0,0 +1,265 @@
+#ifndef COMPRESSED_TEXTURE_H
+#define COMPRESSED_TEXTURE_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Block-compressed image read from a DDS, KTX or KTX2 container. Blocks are
+// uploaded exactly as stored, so files must already be in GL's bottom-up
+// row order (the same orientation stb is asked to produce). sRGB variants
+// map to their linear formats, as plain images are also sampled linearly.
+struct CompressedImage {
+    struct Level {
+        int width, height;
+        size_t offset, size;
+    };
+    GLenum format = 0;
+    std::vector<unsigned char> data;
+    std::vector<Level> levels;
+};
+
+inline bool isCompressedImage(const std::string &file) {
+    std::string extension = file.substr(file.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return extension == "dds" || extension == "ktx" || extension == "ktx2";
+}
+
+inline size_t compressedBlockSize(GLenum format) {
+    switch (format) {
+        case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        case GL_COMPRESSED_RGB8_ETC2:
+        case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+            return 8;
+        case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+        case GL_COMPRESSED_RG_RGTC2:
+        case GL_COMPRESSED_RGBA_BPTC_UNORM:
+        case GL_COMPRESSED_RGBA8_ETC2_EAC:
+            return 16;
+    }
+    return 0;
+}
+
+inline size_t compressedLevelSize(GLenum format, int width, int height) {
+    return size_t((width + 3) / 4) * ((height + 3) / 4) *
+           compressedBlockSize(format);
+}
+
+namespace detail {
+
+template <typename T>
+T read(const std::vector<unsigned char> &data, size_t offset) {
+    T value;
+    std::memcpy(&value, data.data() + offset, sizeof(T));
+    return value;
+}
+
+inline GLenum dxgiFormat(std::uint32_t format) {
+    switch (format) {
+        case 71:  // DXGI_FORMAT_BC1_UNORM
+        case 72:
+            return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+        case 77:  // DXGI_FORMAT_BC3_UNORM
+        case 78:
+            return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case 83:  // DXGI_FORMAT_BC5_UNORM
+            return GL_COMPRESSED_RG_RGTC2;
+        case 98:  // DXGI_FORMAT_BC7_UNORM
+        case 99:
+            return GL_COMPRESSED_RGBA_BPTC_UNORM;
+    }
+    return 0;
+}
+
+inline GLenum vkFormat(std::uint32_t format) {
+    switch (format) {
+        case 131:  // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+        case 132:
+            return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case 133:  // VK_FORMAT_BC1_RGBA_UNORM_BLOCK
+        case 134:
+            return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+        case 137:  // VK_FORMAT_BC3_UNORM_BLOCK
+        case 138:
+            return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case 141:  // VK_FORMAT_BC5_UNORM_BLOCK
+            return GL_COMPRESSED_RG_RGTC2;
+        case 145:  // VK_FORMAT_BC7_UNORM_BLOCK
+        case 146:
+            return GL_COMPRESSED_RGBA_BPTC_UNORM;
+        case 147:  // VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK
+        case 148:
+            return GL_COMPRESSED_RGB8_ETC2;
+        case 149:  // VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK
+        case 150:
+            return GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2;
+        case 151:  // VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK
+        case 152:
+            return GL_COMPRESSED_RGBA8_ETC2_EAC;
+    }
+    return 0;
+}
+
+inline GLenum glCompressedFormat(std::uint32_t format) {
+    switch (format) {
+        case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+            return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+            return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+        case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+            return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+            return GL_COMPRESSED_RGBA_BPTC_UNORM;
+        case GL_COMPRESSED_SRGB8_ETC2:
+            return GL_COMPRESSED_RGB8_ETC2;
+        case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+            return GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2;
+        case GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC:
+            return GL_COMPRESSED_RGBA8_ETC2_EAC;
+    }
+    return compressedBlockSize(format) ? format : 0;
+}
+
+// Lay out a tightly packed mip chain starting at offset, as DDS stores it.
+inline bool packedLevels(CompressedImage &image, int width, int height,
+                         unsigned int count, size_t offset) {
+    for (unsigned int i = 0; i < count; i++) {
+        size_t size = compressedLevelSize(image.format, width, height);
+        if (offset + size > image.data.size()) return false;
+        image.levels.push_back({width, height, offset, size});
+        offset += size;
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    return true;
+}
+
+inline bool parseDDS(CompressedImage &image) {
+    const std::vector<unsigned char> &data = image.data;
+    if (data.size() < 128) return false;
+    int height = read<std::uint32_t>(data, 12);
+    int width = read<std::uint32_t>(data, 16);
+    unsigned int mips = std::max(1u, read<std::uint32_t>(data, 28));
+    size_t offset = 128;
+    if (std::memcmp(&data[84], "DXT1", 4) == 0)
+        image.format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    else if (std::memcmp(&data[84], "DXT5", 4) == 0)
+        image.format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    else if (std::memcmp(&data[84], "ATI2", 4) == 0 ||
+             std::memcmp(&data[84], "BC5U", 4) == 0)
+        image.format = GL_COMPRESSED_RG_RGTC2;
+    else if (std::memcmp(&data[84], "DX10", 4) == 0 && data.size() >= 148) {
+        // Only plain 2D textures: one array element, no cube faces.
+        if (read<std::uint32_t>(data, 140) > 1) return false;
+        image.format = dxgiFormat(read<std::uint32_t>(data, 128));
+        offset += 20;
+    }
+    return image.format && packedLevels(image, width, height, mips, offset);
+}
+
+inline bool parseKTX(CompressedImage &image) {
+    const std::vector<unsigned char> &data = image.data;
+    if (data.size() < 64 || read<std::uint32_t>(data, 12) != 0x04030201)
+        return false;
+    image.format = glCompressedFormat(read<std::uint32_t>(data, 28));
+    int width = read<std::uint32_t>(data, 36);
+    int height = read<std::uint32_t>(data, 40);
+    if (read<std::uint32_t>(data, 48) > 1 || read<std::uint32_t>(data, 52) > 1)
+        return false;
+    unsigned int mips = std::max(1u, read<std::uint32_t>(data, 56));
+    size_t offset = 64 + read<std::uint32_t>(data, 60);
+    for (unsigned int i = 0; i < mips; i++) {
+        if (!image.format || offset + 4 > data.size()) return false;
+        size_t size = read<std::uint32_t>(data, offset);
+        offset += 4;
+        if (offset + size > data.size()) return false;
+        image.levels.push_back({width, height, offset, size});
+        offset += (size + 3) & ~size_t(3);
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    return image.format != 0;
+}
+
+inline bool parseKTX2(CompressedImage &image) {
+    const std::vector<unsigned char> &data = image.data;
+    if (data.size() < 80) return false;
+    image.format = vkFormat(read<std::uint32_t>(data, 12));
+    int width = read<std::uint32_t>(data, 20);
+    int height = read<std::uint32_t>(data, 24);
+    unsigned int mips = std::max(1u, read<std::uint32_t>(data, 40));
+    // Supercompressed (Basis, zstd) payloads would need transcoding.
+    if (read<std::uint32_t>(data, 32) > 1 ||
+        read<std::uint32_t>(data, 36) > 1 || read<std::uint32_t>(data, 44))
+        return false;
+    if (!image.format || data.size() < 80 + size_t(mips) * 24) return false;
+    for (unsigned int i = 0; i < mips; i++) {
+        size_t offset = read<std::uint64_t>(data, 80 + i * 24);
+        size_t size = read<std::uint64_t>(data, 88 + i * 24);
+        if (offset + size > data.size()) return false;
+        image.levels.push_back({width, height, offset, size});
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    return true;
+}
+
+}  // namespace detail
+
+// Parses the container only; touches no GL state.
+inline bool readCompressedImage(const std::string &file,
+                                CompressedImage &image) {
+    std::ifstream stream(file, std::ios::binary);
+    image.data.assign(std::istreambuf_iterator<char>(stream), {});
+    static const unsigned char ktx1[] = {0xAB, 'K', 'T', 'X', ' ', '1', '1'};
+    static const unsigned char ktx2[] = {0xAB, 'K', 'T', 'X', ' ', '2', '0'};
+    bool parsed = false;
+    if (image.data.size() >= 12) {
+        if (std::memcmp(image.data.data(), "DDS ", 4) == 0)
+            parsed = detail::parseDDS(image);
+        else if (std::memcmp(image.data.data(), ktx1, sizeof(ktx1)) == 0)
+            parsed = detail::parseKTX(image);
+        else if (std::memcmp(image.data.data(), ktx2, sizeof(ktx2)) == 0)
+            parsed = detail::parseKTX2(image);
+    }
+    if (!parsed) {
+        std::cerr << "ERROR UNSUPPORTED COMPRESSED TEXTURE AT " << file
+                  << std::endl;
+        image = {};
+    }
+    return parsed;
+}
+
+// Uploads every stored mip level; nothing is generated at load time.
+// Returns false if the driver rejected the format.
+inline bool uploadCompressedImage(const CompressedImage &image) {
+    while (glGetError() != GL_NO_ERROR) continue;
+    for (size_t i = 0; i < image.levels.size(); i++) {
+        const CompressedImage::Level &level = image.levels[i];
+        glCompressedTexImage2D(GL_TEXTURE_2D, i, image.format, level.width,
+                               level.height, 0, level.size,
+                               image.data.data() + level.offset);
+    }
+    if (glGetError() != GL_NO_ERROR) {
+        std::cerr << "ERROR COMPRESSED FORMAT 0x" << std::hex << image.format
+                  << std::dec << " NOT SUPPORTED" << std::endl;
+        return false;
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL,
+                    image.levels.size() - 1);
+    if (image.levels.size() == 1)
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    return true;
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+#include <vertex_format.h>
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_SSE 1
+#endif
+
+struct Sphere {
+    glm::vec3 center;
+    float radius;
+};
+
+// Centred on the bounds, which is tighter than the box's circumsphere for
+// most meshes.
+inline Sphere boundingSphere(const Vertex *vertices, size_t count,
+                             const Bounds &bounds) {
+    Sphere sphere = {(bounds.min + bounds.max) * 0.5f, 0.0f};
+    float radius2 = 0.0f;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 d = vertices[i].position - sphere.center;
+        radius2 = glm::max(radius2, glm::dot(d, d));
+    }
+    sphere.radius = glm::sqrt(radius2);
+    return sphere;
+}
+
+inline Bounds transformBounds(const Bounds &bounds, const glm::mat4 &model) {
+    glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+    center = glm::vec3(model * glm::vec4(center, 1.0f));
+    glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+    glm::mat3 axes(model);
+    glm::vec3 worldExtent = glm::abs(axes[0]) * extent.x +
+                            glm::abs(axes[1]) * extent.y +
+                            glm::abs(axes[2]) * extent.z;
+    return {center - worldExtent, center + worldExtent};
+}
+
+inline Sphere transformSphere(const Sphere &sphere, const glm::mat4 &model) {
+    glm::mat3 axes(model);
+    float scale = glm::sqrt(glm::max(glm::dot(axes[0], axes[0]),
+                                     glm::max(glm::dot(axes[1], axes[1]),
+                                              glm::dot(axes[2], axes[2]))));
+    return {glm::vec3(model * glm::vec4(sphere.center, 1.0f)),
+            sphere.radius * scale};
+}
+
+// Six normalized planes (left, right, bottom, top, near, far) pointing
+// inwards, extracted from projection * view.
+struct Frustum {
+    glm::vec4 planes[6];
+
+    static Frustum fromMatrix(const glm::mat4 &viewProjection) {
+        glm::mat4 m = glm::transpose(viewProjection);
+        Frustum frustum;
+        frustum.planes[0] = m[3] + m[0];
+        frustum.planes[1] = m[3] - m[0];
+        frustum.planes[2] = m[3] + m[1];
+        frustum.planes[3] = m[3] - m[1];
+        frustum.planes[4] = m[3] + m[2];
+        frustum.planes[5] = m[3] - m[2];
+        for (glm::vec4 &plane : frustum.planes)
+            plane /= glm::length(glm::vec3(plane));
+        return frustum;
+    }
+
+    bool intersects(const Sphere &sphere) const {
+        for (const glm::vec4 &plane : planes) {
+            if (glm::dot(glm::vec3(plane), sphere.center) + plane.w <
+                -sphere.radius)
+                return false;
+        }
+        return true;
+    }
+    bool intersects(const Bounds &bounds) const {
+        glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+        glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+        for (const glm::vec4 &plane : planes) {
+            glm::vec3 normal(plane);
+            if (glm::dot(normal, center) + plane.w <
+                -glm::dot(glm::abs(normal), extent))
+                return false;
+        }
+        return true;
+    }
+};
+
+// World-space bounds of many objects in structure-of-arrays form, so the
+// frustum test runs on four objects per iteration. An object is culled
+// when either its box or its sphere is outside a plane.
+class CullingSet {
+   public:
+    static inline bool simd = true;
+
+    void clear() {
+        for (std::vector<float> *column :
+             {&centerX, &centerY, &centerZ, &extentX, &extentY, &extentZ,
+              &sphereX, &sphereY, &sphereZ, &radius})
+            column->clear();
+    }
+    size_t size() const { return radius.size(); }
+
+    std::uint32_t add(const Bounds &bounds, const Sphere &sphere) {
+        glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+        glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+        centerX.push_back(center.x);
+        centerY.push_back(center.y);
+        centerZ.push_back(center.z);
+        extentX.push_back(extent.x);
+        extentY.push_back(extent.y);
+        extentZ.push_back(extent.z);
+        sphereX.push_back(sphere.center.x);
+        sphereY.push_back(sphere.center.y);
+        sphereZ.push_back(sphere.center.z);
+        radius.push_back(sphere.radius);
+        return radius.size() - 1;
+    }
+
+    // Keep only the objects at the given ascending indices, renumbered
+    // from zero.
+    void keep(const std::vector<std::uint32_t> &indices) {
+        for (std::vector<float> *column :
+             {&centerX, &centerY, &centerZ, &extentX, &extentY, &extentZ,
+              &sphereX, &sphereY, &sphereZ, &radius}) {
+            for (size_t i = 0; i < indices.size(); i++)
+                (*column)[i] = (*column)[indices[i]];
+            column->resize(indices.size());
+        }
+    }
+
+    // Indices of the objects at least partly inside the frustum, in order.
+    void cull(const Frustum &frustum, std::vector<std::uint32_t> &visible) {
+        visible.clear();
+        size_t i = 0;
+#ifdef FRUSTUM_SSE
+        if (simd) {
+            for (; i + 4 <= size(); i += 4) {
+                int mask = cullFour(frustum, i);
+                for (int lane = 0; lane < 4; lane++)
+                    if (mask >> lane & 1) visible.push_back(i + lane);
+            }
+        }
+#endif
+        for (; i < size(); i++)
+            if (inside(frustum, i)) visible.push_back(i);
+    }
+
+   private:
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+    std::vector<float> sphereX, sphereY, sphereZ, radius;
+
+    bool inside(const Frustum &frustum, size_t i) const {
+        for (const glm::vec4 &p : frustum.planes) {
+            float box = p.x * centerX[i] + p.y * centerY[i] +
+                        p.z * centerZ[i] + p.w;
+            float reach = glm::abs(p.x) * extentX[i] +
+                          glm::abs(p.y) * extentY[i] +
+                          glm::abs(p.z) * extentZ[i];
+            float sphere = p.x * sphereX[i] + p.y * sphereY[i] +
+                           p.z * sphereZ[i] + p.w;
+            if (box < -reach || sphere < -radius[i]) return false;
+        }
+        return true;
+    }
+
+#ifdef FRUSTUM_SSE
+    // Bit n of the result is set when object i + n is visible.
+    int cullFour(const Frustum &frustum, size_t i) const {
+        __m128 cx = _mm_loadu_ps(&centerX[i]);
+        __m128 cy = _mm_loadu_ps(&centerY[i]);
+        __m128 cz = _mm_loadu_ps(&centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&extentX[i]);
+        __m128 ey = _mm_loadu_ps(&extentY[i]);
+        __m128 ez = _mm_loadu_ps(&extentZ[i]);
+        __m128 sx = _mm_loadu_ps(&sphereX[i]);
+        __m128 sy = _mm_loadu_ps(&sphereY[i]);
+        __m128 sz = _mm_loadu_ps(&sphereZ[i]);
+        __m128 r = _mm_loadu_ps(&radius[i]);
+        __m128 outside = _mm_setzero_ps();
+        for (const glm::vec4 &p : frustum.planes) {
+            __m128 nx = _mm_set1_ps(p.x), ny = _mm_set1_ps(p.y);
+            __m128 nz = _mm_set1_ps(p.z), w = _mm_set1_ps(p.w);
+            __m128 box = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                _mm_add_ps(_mm_mul_ps(nz, cz), w));
+            __m128 reach = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(_mm_set1_ps(glm::abs(p.x)), ex),
+                           _mm_mul_ps(_mm_set1_ps(glm::abs(p.y)), ey)),
+                _mm_mul_ps(_mm_set1_ps(glm::abs(p.z)), ez));
+            __m128 sphere = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(nx, sx), _mm_mul_ps(ny, sy)),
+                _mm_add_ps(_mm_mul_ps(nz, sz), w));
+            outside = _mm_or_ps(
+                outside,
+                _mm_or_ps(_mm_cmplt_ps(_mm_add_ps(box, reach),
+                                       _mm_setzero_ps()),
+                          _mm_cmplt_ps(_mm_add_ps(sphere, r),
+                                       _mm_setzero_ps())));
+        }
+        return ~_mm_movemask_ps(outside) & 0xf;
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <gl_state.h>
+#include <shader.h>
+#include <shader_variants.h>
+
+#include <iostream>
+
+// Render target of deferred shading. The geometry pass draws the scene
+// with shaders/gbuffer.frag, which stores the surface attributes
+// fragment.frag would light; a full screen pass then lights every pixel
+// once with shaders/deferred.frag, so overdraw no longer multiplies the
+// light loops. Per frame:
+//
+//     gbuffer.resize(width, height);
+//     if (!gbuffer.complete()) ... draw forward instead ...
+//     gbuffer.begin();
+//     ... draw the scene with G-buffer shaders ...
+//     gbuffer.end();
+//     gbuffer.light(projection * view);
+class GBuffer {
+   public:
+    // Albedo RGB; specular RGB and shininess / 255; octahedral normal.
+    enum Target { ALBEDO_TARGET = 0, SPECULAR_TARGET, NORMAL_TARGET, TARGETS };
+
+    GBuffer(int width, int height)
+        : lightShaders("./shaders/fullscreen.vert", "./shaders/deferred.frag",
+                       lightingDefines(), [](Shader &shader) {
+                           shader.set("gAlbedo", int(ALBEDO_TARGET));
+                           shader.set("gSpecular", int(SPECULAR_TARGET));
+                           shader.set("gNormal", int(NORMAL_TARGET));
+                           shader.set("gDepth", int(TARGETS));
+                       },
+                       lightingPrelude()) {
+        glGenFramebuffers(1, &framebuffer);
+        glGenVertexArrays(1, &emptyVertexArray);
+        resize(width, height);
+    }
+    ~GBuffer() {
+        GLState &state = GLState::instance();
+        state.deleteFramebuffer(framebuffer);
+        state.deleteVertexArray(emptyVertexArray);
+        for (GLuint texture : textures) state.deleteTexture(texture);
+        state.deleteTexture(depthTexture);
+    }
+    GBuffer(const GBuffer &) = delete;
+    GBuffer &operator=(const GBuffer &) = delete;
+
+    // Match the resolution of the frame; no-op when unchanged.
+    void resize(int width, int height) {
+        if (width <= 0 || height <= 0) return;
+        if (width == this->width && height == this->height) return;
+        this->width = width;
+        this->height = height;
+
+        GLState &state = GLState::instance();
+        for (GLuint &texture : textures) {
+            if (texture) state.deleteTexture(texture);
+            texture = 0;
+        }
+        if (depthTexture) state.deleteTexture(depthTexture);
+        // Signed normalized formats need not be renderable in core GL.
+        const GLenum formats[TARGETS] = {GL_RGBA8, GL_RGBA8, GL_RG16F};
+        for (int target = 0; target < TARGETS; target++)
+            textures[target] = createTexture(formats[target]);
+        depthTexture = createTexture(GL_DEPTH_COMPONENT32F);
+
+        GLint previous;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        state.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        GLenum attachments[TARGETS];
+        for (int target = 0; target < TARGETS; target++) {
+            attachments[target] = GL_COLOR_ATTACHMENT0 + target;
+            glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[target],
+                                   GL_TEXTURE_2D, textures[target], 0);
+        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_2D, depthTexture, 0);
+        glDrawBuffers(TARGETS, attachments);
+        usable = glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+                 GL_FRAMEBUFFER_COMPLETE;
+        if (!usable) std::cerr << "ERROR G-BUFFER INCOMPLETE" << std::endl;
+        state.bindFramebuffer(GL_FRAMEBUFFER, previous);
+    }
+
+    // Clear the G-buffer and direct draws into it.
+    void begin() {
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        GLState::instance().bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        const GLfloat zero[4] = {0.0f, 0.0f, 0.0f, 0.0f}, one = 1.0f;
+        for (int target = 0; target < TARGETS; target++)
+            glClearBufferfv(GL_COLOR, target, zero);
+        glDepthMask(GL_TRUE);
+        glClearBufferfv(GL_DEPTH, 0, &one);
+    }
+    void end() {
+        GLState::instance().bindFramebuffer(GL_FRAMEBUFFER, previous);
+    }
+
+    // Light the covered pixels of the bound framebuffer and copy the
+    // G-buffer depth into it, so forward draws can follow. Empty pixels
+    // keep what is there.
+    void light(const glm::mat4 &viewProjection) {
+        GLState &state = GLState::instance();
+        for (int target = 0; target < TARGETS; target++)
+            state.bindTexture(target, GL_TEXTURE_2D, textures[target]);
+        state.bindTexture(TARGETS, GL_TEXTURE_2D, depthTexture);
+        Shader &lightShader = lightShaders.get();
+        lightShader.use();
+        lightShader.set("inverseViewProjection",
+                        glm::inverse(viewProjection));
+
+        GLint depthFunc;
+        glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
+        bool culling = state.enabled(GL_CULL_FACE);
+        state.disable(GL_CULL_FACE);
+        state.enable(GL_DEPTH_TEST);
+        glDepthFunc(GL_ALWAYS);
+        state.bindVertexArray(emptyVertexArray);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glDepthFunc(depthFunc);
+        state.set(GL_CULL_FACE, culling);
+    }
+
+    // Whether the last resize() produced a framebuffer that can be drawn
+    // into; deferred shading must not be used otherwise.
+    bool complete() const { return usable; }
+    GLuint getTexture(Target target) const { return textures[target]; }
+    GLuint getDepthTexture() const { return depthTexture; }
+
+   private:
+    ShaderVariants lightShaders;
+    GLuint framebuffer = 0, emptyVertexArray = 0;
+    GLuint textures[TARGETS] = {}, depthTexture = 0;
+    GLint previous = 0;
+    bool usable = false;
+    int width = 0, height = 0;
+
+    GLuint createTexture(GLenum format) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        GLState &state = GLState::instance();
+        state.bindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        return texture;
+    }
+};
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef GEOMETRY_ARENA_H
+#define GEOMETRY_ARENA_H
+
+#include <GL/glew.h>
+
+#include <gl_state.h>
+#include <vertex_format.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Narrowest index type that can address vertexCount vertices. Byte indices
+// are opt-in, as several drivers convert them on the CPU at draw time.
+inline GLenum indexTypeFor(size_t vertexCount, bool allowBytes = false) {
+    if (allowBytes && vertexCount <= 0x100) return GL_UNSIGNED_BYTE;
+    if (vertexCount <= 0x10000) return GL_UNSIGNED_SHORT;
+    return GL_UNSIGNED_INT;
+}
+
+inline size_t indexSize(GLenum type) {
+    return type == GL_UNSIGNED_BYTE ? 1 : type == GL_UNSIGNED_SHORT ? 2 : 4;
+}
+
+// Copy 32-bit indices into the storage of a narrower index type.
+inline std::vector<unsigned char> narrowIndices(const unsigned int *indices,
+                                                size_t count, GLenum type) {
+    std::vector<unsigned char> narrowed(count * indexSize(type));
+    for (size_t i = 0; i < count; i++) {
+        if (type == GL_UNSIGNED_BYTE)
+            narrowed[i] = static_cast<unsigned char>(indices[i]);
+        else if (type == GL_UNSIGNED_SHORT)
+            reinterpret_cast<unsigned short *>(narrowed.data())[i] =
+                static_cast<unsigned short>(indices[i]);
+        else
+            reinterpret_cast<unsigned int *>(narrowed.data())[i] = indices[i];
+    }
+    return narrowed;
+}
+
+// First-fit allocator over [0, capacity) that merges neighbouring free
+// ranges. Works in caller-chosen units.
+class RangeAllocator {
+   public:
+    static constexpr size_t FAILED = ~size_t(0);
+
+    size_t capacity() const { return total; }
+    void grow(size_t capacity) {
+        if (capacity <= total) return;
+        free(total, capacity - total);
+        total = capacity;
+    }
+    size_t allocate(size_t size, size_t alignment = 1) {
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            size_t start = (it->first + alignment - 1) / alignment * alignment;
+            size_t end = it->first + it->second;
+            if (start + size > end) continue;
+            size_t offset = it->first;
+            ranges.erase(it);
+            if (start > offset) ranges.emplace(offset, start - offset);
+            if (start + size < end)
+                ranges.emplace(start + size, end - start - size);
+            return start;
+        }
+        return FAILED;
+    }
+    void free(size_t offset, size_t size) {
+        if (size == 0) return;
+        auto next = ranges.lower_bound(offset);
+        if (next != ranges.end() && offset + size == next->first) {
+            size += next->second;
+            next = ranges.erase(next);
+        }
+        if (next != ranges.begin()) {
+            auto previous = std::prev(next);
+            if (previous->first + previous->second == offset) {
+                previous->second += size;
+                return;
+            }
+        }
+        ranges.emplace(offset, size);
+    }
+    // End of the last allocated unit, i.e. how much storage is in use.
+    size_t highWater() const {
+        if (ranges.empty()) return total;
+        auto last = std::prev(ranges.end());
+        return last->first + last->second == total ? last->first : total;
+    }
+
+   private:
+    std::map<size_t, size_t> ranges;  // offset -> size of free space
+    size_t total = 0;
+};
+
+// Suballocates mesh geometry from a few large buffers: one vertex buffer,
+// index buffer and VAO per vertex format. Meshes keep only offsets, so
+// every mesh of a format draws from the same VAO with base vertex and
+// first index. Buffers grow by copying when full; offsets stay valid.
+class GeometryArena {
+   public:
+    struct Allocation {
+        VertexFormat format;
+        GLenum indexType = GL_UNSIGNED_INT;
+        GLint baseVertex = 0;
+        GLuint vertexCount = 0;
+        GLuint firstIndex = 0;  // in units of indexType
+        GLsizei indexCount = 0;
+
+        const void *indexOffset() const {
+            return reinterpret_cast<const void *>(size_t(firstIndex) *
+                                                  indexSize(indexType));
+        }
+    };
+
+    static inline size_t initialVertexBytes = 16 << 20;
+    static inline size_t initialIndexBytes = 8 << 20;
+
+    static GeometryArena &instance() {
+        static GeometryArena arena;
+        return arena;
+    }
+
+    // Copies packed vertices (format.stride() bytes each) and indices of
+    // indexType into the arena. Must run on the GL thread.
+    Allocation allocate(VertexFormat format, const void *vertices,
+                        size_t vertexCount, GLenum indexType,
+                        const void *indices, size_t indexCount) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Pool &pool = poolFor(format);
+        size_t stride = format.stride();
+        size_t size = indexSize(indexType);
+
+        size_t vertex = pool.vertices.allocate(vertexCount);
+        if (vertex == RangeAllocator::FAILED) {
+            growVertices(pool, format, vertexCount);
+            vertex = pool.vertices.allocate(vertexCount);
+        }
+        // Index storage is counted in bytes so all index types can share
+        // one buffer; each range is aligned to its own index size.
+        size_t index = pool.indices.allocate(indexCount * size, size);
+        if (index == RangeAllocator::FAILED) {
+            growIndices(pool, indexCount * size + size);
+            index = pool.indices.allocate(indexCount * size, size);
+        }
+
+        GLState &state = GLState::instance();
+        state.bindBuffer(GL_COPY_WRITE_BUFFER, pool.vbo);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, vertex * stride,
+                        vertexCount * stride, vertices);
+        state.bindBuffer(GL_COPY_WRITE_BUFFER, pool.ebo);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, index, indexCount * size,
+                        indices);
+        return {format,
+                indexType,
+                static_cast<GLint>(vertex),
+                static_cast<GLuint>(vertexCount),
+                static_cast<GLuint>(index / size),
+                static_cast<GLsizei>(indexCount)};
+    }
+
+    // Return a mesh's ranges for reuse. Touches no GL state.
+    void release(const Allocation &allocation) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pools.find(allocation.format.key());
+        if (it == pools.end()) return;
+        size_t size = indexSize(allocation.indexType);
+        it->second.vertices.free(allocation.baseVertex,
+                                 allocation.vertexCount);
+        it->second.indices.free(size_t(allocation.firstIndex) * size,
+                                allocation.indexCount * size);
+    }
+
+    GLuint vao(VertexFormat format) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return poolFor(format).vao;
+    }
+    size_t poolCount() const { return pools.size(); }
+
+   private:
+    struct Pool {
+        GLuint vao = 0, vbo = 0, ebo = 0;
+        RangeAllocator vertices;  // in vertices
+        RangeAllocator indices;   // in bytes
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::uint32_t, Pool> pools;
+
+    GeometryArena() = default;
+
+    Pool &poolFor(VertexFormat format) {
+        auto [it, created] = pools.try_emplace(format.key());
+        Pool &pool = it->second;
+        if (!created) return pool;
+        glGenVertexArrays(1, &pool.vao);
+        pool.vbo = createBuffer(initialVertexBytes);
+        pool.ebo = createBuffer(initialIndexBytes);
+        pool.vertices.grow(initialVertexBytes / format.stride());
+        pool.indices.grow(initialIndexBytes);
+        attach(pool, format);
+        return pool;
+    }
+
+    static GLuint createBuffer(size_t size) {
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        GLState::instance().bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+        return buffer;
+    }
+
+    // Replace buffer with a copy of its first used bytes in a larger one.
+    static GLuint regrow(GLuint buffer, size_t used, size_t size) {
+        GLuint grown = createBuffer(size);
+        GLState::instance().bindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                            used);
+        GLState::instance().deleteBuffer(buffer);
+        return grown;
+    }
+
+    void growVertices(Pool &pool, VertexFormat format, size_t needed) {
+        size_t capacity = pool.vertices.capacity();
+        size_t grown = std::max(capacity * 2, capacity + needed);
+        size_t stride = format.stride();
+        pool.vbo = regrow(pool.vbo, pool.vertices.highWater() * stride,
+                          grown * stride);
+        pool.vertices.grow(grown);
+        attach(pool, format);
+    }
+
+    void growIndices(Pool &pool, size_t needed) {
+        size_t capacity = pool.indices.capacity();
+        size_t grown = std::max(capacity * 2, capacity + needed);
+        pool.ebo = regrow(pool.ebo, pool.indices.highWater(), grown);
+        pool.indices.grow(grown);
+        GLState &state = GLState::instance();
+        state.bindVertexArray(pool.vao);
+        state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.ebo);
+    }
+
+    static void attach(const Pool &pool, VertexFormat format) {
+        GLState &state = GLState::instance();
+        state.bindVertexArray(pool.vao);
+        state.bindBuffer(GL_ARRAY_BUFFER, pool.vbo);
+        format.setAttributes();
+        state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.ebo);
+    }
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <unordered_map>
+
+// Shadow of the binding and enable state of the current context. Calls
+// that would leave the state unchanged are dropped and counted. Everything
+// that binds state must go through here, or call invalidate() afterwards,
+// and names must be deleted through the delete* functions, since the
+// driver may hand them out again.
+class GLState {
+   public:
+    struct Counters {
+        size_t issued = 0;
+        size_t filtered = 0;
+    };
+
+    static GLState &instance() {
+        static GLState state;
+        return state;
+    }
+
+    const Counters &counters() const { return calls; }
+    void resetCounters() { calls = {}; }
+
+    // Forget everything, e.g. after code that binds with raw GL calls.
+    void invalidate() {
+        program = vertexArray = UNKNOWN;
+        drawFramebuffer = readFramebuffer = UNKNOWN;
+        unit = UNKNOWN;
+        textures.clear();
+        buffers.clear();
+        elementBuffers.clear();
+        capabilities.clear();
+    }
+
+    void useProgram(GLuint id) {
+        if (filter(program, id)) return;
+        glUseProgram(id);
+    }
+    void bindVertexArray(GLuint id) {
+        if (filter(vertexArray, id)) return;
+        glBindVertexArray(id);
+    }
+    // GL_FRAMEBUFFER sets both the draw and the read binding.
+    void bindFramebuffer(GLenum target, GLuint id) {
+        if (target == GL_FRAMEBUFFER) {
+            if (drawFramebuffer == id && readFramebuffer == id) {
+                calls.filtered++;
+                return;
+            }
+            drawFramebuffer = readFramebuffer = id;
+            calls.issued++;
+        } else if (filter(target == GL_READ_FRAMEBUFFER ? readFramebuffer
+                                                         : drawFramebuffer,
+                          id)) {
+            return;
+        }
+        glBindFramebuffer(target, id);
+    }
+    void activeTexture(GLenum texture) {
+        if (filter(unit, texture - GL_TEXTURE0)) return;
+        glActiveTexture(texture);
+    }
+    // Binds to the active texture unit.
+    void bindTexture(GLenum target, GLuint id) {
+        if (unit == UNKNOWN) activeTexture(GL_TEXTURE0);
+        if (filter(texture(unit, target), id)) return;
+        glBindTexture(target, id);
+    }
+    void bindTexture(GLuint textureUnit, GLenum target, GLuint id) {
+        if (filter(texture(textureUnit, target), id)) return;
+        activeTexture(GL_TEXTURE0 + textureUnit);
+        glBindTexture(target, id);
+    }
+    // The element array binding is part of the bound VAO.
+    void bindBuffer(GLenum target, GLuint id) {
+        if (target == GL_ELEMENT_ARRAY_BUFFER && vertexArray == UNKNOWN) {
+            calls.issued++;
+            glBindBuffer(target, id);
+            return;
+        }
+        GLuint &bound = target == GL_ELEMENT_ARRAY_BUFFER
+                            ? elementBuffer(vertexArray)
+                            : buffer(target);
+        if (filter(bound, id)) return;
+        glBindBuffer(target, id);
+    }
+    // Indexed bindings are not shadowed, but they also set the generic
+    // binding point.
+    void bindBufferBase(GLenum target, GLuint index, GLuint id) {
+        calls.issued++;
+        glBindBufferBase(target, index, id);
+        buffer(target) = id;
+    }
+    void enable(GLenum capability) { set(capability, true); }
+    void disable(GLenum capability) { set(capability, false); }
+    void set(GLenum capability, bool enabled) {
+        auto [it, inserted] = capabilities.try_emplace(capability, enabled);
+        if (!inserted && it->second == enabled) {
+            calls.filtered++;
+            return;
+        }
+        it->second = enabled;
+        calls.issued++;
+        if (enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+    bool enabled(GLenum capability) {
+        auto [it, inserted] = capabilities.try_emplace(capability, false);
+        if (inserted) it->second = glIsEnabled(capability);
+        return it->second;
+    }
+
+    void deleteTexture(GLuint id) {
+        glDeleteTextures(1, &id);
+        for (auto &[key, bound] : textures)
+            if (bound == id) bound = 0;
+    }
+    void deleteBuffer(GLuint id) {
+        glDeleteBuffers(1, &id);
+        for (auto &[target, bound] : buffers)
+            if (bound == id) bound = 0;
+        for (auto &[vao, bound] : elementBuffers)
+            if (bound == id) bound = 0;
+    }
+    void deleteVertexArray(GLuint id) {
+        glDeleteVertexArrays(1, &id);
+        elementBuffers.erase(id);
+        if (vertexArray == id) vertexArray = 0;
+    }
+    void deleteFramebuffer(GLuint id) {
+        glDeleteFramebuffers(1, &id);
+        if (drawFramebuffer == id) drawFramebuffer = 0;
+        if (readFramebuffer == id) readFramebuffer = 0;
+    }
+    void deleteProgram(GLuint id) {
+        glDeleteProgram(id);
+        if (program == id) program = 0;
+    }
+
+   private:
+    static constexpr GLuint UNKNOWN = ~GLuint(0);
+
+    GLuint program = UNKNOWN;
+    GLuint vertexArray = UNKNOWN;
+    GLuint drawFramebuffer = UNKNOWN;
+    GLuint readFramebuffer = UNKNOWN;
+    GLuint unit = UNKNOWN;
+    std::unordered_map<std::uint64_t, GLuint> textures;
+    std::unordered_map<GLenum, GLuint> buffers;
+    std::unordered_map<GLuint, GLuint> elementBuffers;
+    std::unordered_map<GLenum, bool> capabilities;
+    Counters calls;
+
+    GLState() = default;
+
+    GLuint &texture(GLuint unit, GLenum target) {
+        std::uint64_t key = std::uint64_t(unit) << 32 | target;
+        return textures.try_emplace(key, UNKNOWN).first->second;
+    }
+    GLuint &buffer(GLenum target) {
+        return buffers.try_emplace(target, UNKNOWN).first->second;
+    }
+    GLuint &elementBuffer(GLuint vao) {
+        return elementBuffers.try_emplace(vao, UNKNOWN).first->second;
+    }
+
+    // Returns true when the call can be dropped, otherwise records value.
+    bool filter(GLuint &current, GLuint value) {
+        if (current == value) {
+            calls.filtered++;
+            return true;
+        }
+        current = value;
+        calls.issued++;
+        return false;
+    }
+};
+
+#endif
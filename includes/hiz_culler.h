@@ -0,0 +1,178 @@
+#ifndef HIZ_CULLER_H
+#define HIZ_CULLER_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <gl_state.h>
+#include <indirect_batch.h>
+#include <shader.h>
+#include <vertex_format.h>
+
+#include <algorithm>
+#include <iostream>
+
+// GPU occlusion culling against a hierarchical depth buffer. Large
+// occluders are drawn depth-only into an offscreen target, which is
+// reduced into a mip pyramid holding the farthest depth of each region.
+// A compute pass then tests the bounds of every draw in an IndirectBatch
+// against it and zeroes the instance count of hidden ones, so they never
+// reach the vertex stage. Per frame:
+//
+//     culler.build(occluders);
+//     batch.prepare();
+//     culler.cull(batch, projection * view);
+//     batch.submit(shader);
+class HiZCuller {
+   public:
+    // Objects covering at least this fraction of the screen are drawn
+    // into the depth pre-pass.
+    static inline float occluderArea = 0.05f;
+
+    static constexpr GLuint BUILD_GROUP_SIZE = 8;
+    static constexpr GLuint CULL_GROUP_SIZE = 64;
+
+    HiZCuller(int width, int height)
+        : depthShader("./shaders/indirect.vert", "./shaders/depth.frag"),
+          buildShader("./shaders/hiz_build.comp"),
+          cullShader("./shaders/hiz_cull.comp") {
+        glGenFramebuffers(1, &framebuffer);
+        buildShader.set("source", 0);
+        cullShader.set("hiZ", 0);
+        resize(width, height);
+    }
+    ~HiZCuller() {
+        GLState &state = GLState::instance();
+        state.deleteFramebuffer(framebuffer);
+        state.deleteTexture(depthTexture);
+        state.deleteTexture(pyramid);
+    }
+    HiZCuller(const HiZCuller &) = delete;
+    HiZCuller &operator=(const HiZCuller &) = delete;
+
+    // Match the resolution of the frame being culled; no-op when
+    // unchanged.
+    void resize(int width, int height) {
+        if (width <= 0 || height <= 0) return;
+        if (width == this->width && height == this->height) return;
+        this->width = width;
+        this->height = height;
+        levels = 1;
+        while (std::max(width, height) >> levels) levels++;
+
+        GLState &state = GLState::instance();
+        if (depthTexture) state.deleteTexture(depthTexture);
+        if (pyramid) state.deleteTexture(pyramid);
+        glGenTextures(1, &depthTexture);
+        state.bindTexture(GL_TEXTURE_2D, depthTexture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenTextures(1, &pyramid);
+        state.bindTexture(GL_TEXTURE_2D, pyramid);
+        glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                        GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        GLint previous;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        state.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_2D, depthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+            GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR HI-Z FRAMEBUFFER INCOMPLETE" << std::endl;
+        state.bindFramebuffer(GL_FRAMEBUFFER, previous);
+    }
+
+    // Whether bounds cover enough of the screen to be worth drawing as an
+    // occluder. Bounds reaching behind the camera always are.
+    static bool isOccluder(const Bounds &bounds,
+                           const glm::mat4 &viewProjection) {
+        glm::vec2 min(1.0f), max(-1.0f);
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 point(corner & 1 ? bounds.max.x : bounds.min.x,
+                            corner & 2 ? bounds.max.y : bounds.min.y,
+                            corner & 4 ? bounds.max.z : bounds.min.z);
+            glm::vec4 clip = viewProjection * glm::vec4(point, 1.0f);
+            if (clip.w <= 0.0f) return true;
+            glm::vec2 ndc = glm::vec2(clip) / clip.w;
+            min = glm::min(min, ndc);
+            max = glm::max(max, ndc);
+        }
+        glm::vec2 extent =
+            glm::clamp(max, -1.0f, 1.0f) - glm::clamp(min, -1.0f, 1.0f);
+        return extent.x > 0.0f && extent.y > 0.0f &&
+               extent.x * extent.y * 0.25f >= occluderArea;
+    }
+
+    // Depth pre-pass of the occluders, then the pyramid built from it.
+    void build(IndirectBatch &occluders) {
+        GLState &state = GLState::instance();
+        GLint viewport[4], previous;
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        state.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+        state.enable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        occluders.draw(depthShader);
+        state.bindFramebuffer(GL_FRAMEBUFFER, previous);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+        buildShader.use();
+        state.bindTexture(0, GL_TEXTURE_2D, depthTexture);
+        dispatchLevel(0, 0, false);
+        state.bindTexture(0, GL_TEXTURE_2D, pyramid);
+        for (int level = 1; level < levels; level++)
+            dispatchLevel(level, level - 1, true);
+    }
+
+    // Zero the instance count of the draws in batch hidden behind the
+    // occluders. Call between batch.prepare() and batch.submit().
+    void cull(IndirectBatch &batch, const glm::mat4 &viewProjection) {
+        if (batch.size() == 0) return;
+        GLState &state = GLState::instance();
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMANDS_BINDING,
+                             batch.getCommandBuffer());
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, BOUNDS_BINDING,
+                             batch.getBoundsBuffer());
+        state.bindTexture(0, GL_TEXTURE_2D, pyramid);
+        cullShader.use();
+        cullShader.set("viewProjection", viewProjection);
+        cullShader.set("drawCount", int(batch.size()));
+        glDispatchCompute(groups(batch.size(), CULL_GROUP_SIZE), 1, 1);
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+    }
+
+    GLuint getDepthTexture() const { return depthTexture; }
+    GLuint getPyramid() const { return pyramid; }
+    int getLevels() const { return levels; }
+
+   private:
+    Shader depthShader, buildShader, cullShader;
+    GLuint framebuffer = 0, depthTexture = 0, pyramid = 0;
+    int width = 0, height = 0, levels = 0;
+
+    static GLuint groups(GLuint count, GLuint size) {
+        return (count + size - 1) / size;
+    }
+
+    void dispatchLevel(int level, int sourceLevel, bool downsample) {
+        GLuint levelWidth = std::max(width >> level, 1);
+        GLuint levelHeight = std::max(height >> level, 1);
+        buildShader.set("sourceLevel", sourceLevel);
+        buildShader.set("downsample", int(downsample));
+        glBindImageTexture(0, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY,
+                           GL_R32F);
+        glDispatchCompute(groups(levelWidth, BUILD_GROUP_SIZE),
+                          groups(levelHeight, BUILD_GROUP_SIZE), 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+};
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef INDIRECT_BATCH_H
+#define INDIRECT_BATCH_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <frustum.h>
+#include <geometry_arena.h>
+#include <gl_state.h>
+#include <mesh.h>
+#include <shader.h>
+#include <shader_variants.h>
+#include <software_occlusion.h>
+#include <uniform_buffer.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Layout fixed by the GL spec for glMultiDrawElementsIndirect.
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// Mirrors the std430 DrawData struct in shaders/indirect.vert.
+struct DrawData {
+    glm::mat4 model;
+    glm::mat4 normalModel;
+    glm::vec4 positionScale;
+    glm::vec4 positionOffset;
+    std::uint32_t octahedralNormals;
+    std::uint32_t material;
+    std::uint32_t padding[2];
+};
+
+// World-space bounds of a draw, as read by shaders/hiz_cull.comp.
+struct DrawBounds {
+    glm::vec4 min;
+    glm::vec4 max;
+};
+
+// Collects mesh draws for a frame and submits them with one
+// glMultiDrawElementsIndirect per vertex format, index type and texture
+// set. Transforms and dequantization come from an SSBO indexed by a
+// per-draw attribute that reads baseInstance, so GL 4.3 is enough.
+class IndirectBatch {
+   public:
+    static constexpr GLuint DRAW_INDEX_LOCATION = 10;
+
+    IndirectBatch() {
+        glGenBuffers(1, &commandBuffer);
+        glGenBuffers(1, &dataBuffer);
+        glGenBuffers(1, &indexBuffer);
+        glGenBuffers(1, &boundsBuffer);
+    }
+    IndirectBatch(const IndirectBatch &) = delete;
+    IndirectBatch &operator=(const IndirectBatch &) = delete;
+
+    void clear() {
+        draws.clear();
+        culling.clear();
+        materials.clear();
+        materialMeshes.clear();
+        lastCulled = 0;
+    }
+    void add(const Mesh &mesh, const glm::mat4 &model) {
+        const GeometryArena::Allocation &geometry = mesh.geometry;
+        Draw draw;
+        draw.command = {GLuint(geometry.indexCount), 1, geometry.firstIndex,
+                        geometry.baseVertex, 0};
+        draw.data.model = model;
+        draw.data.normalModel =
+            glm::mat4(glm::mat3(glm::transpose(glm::inverse(model))));
+        draw.data.positionScale = glm::vec4(
+            VertexFormat::positionScale(mesh.format, mesh.bounds), 0.0f);
+        draw.data.positionOffset = glm::vec4(
+            VertexFormat::positionOffset(mesh.format, mesh.bounds), 0.0f);
+        draw.data.octahedralNormals = mesh.format.normal == NORMAL_OCTAHEDRAL;
+        draw.data.material = materials.add(mesh.textures);
+        if (draw.data.material == materialMeshes.size())
+            materialMeshes.push_back(&mesh);
+        draw.format = mesh.format;
+        draw.indexType = geometry.indexType;
+        draw.bounds = transformBounds(mesh.bounds, model);
+        draws.push_back(draw);
+        culling.add(draw.bounds, transformSphere(mesh.sphere, model));
+    }
+    // Drop the draws outside frustum.
+    void cull(const Frustum &frustum) {
+        culling.cull(frustum, visible);
+        keep(visible);
+    }
+    // Drop the draws hidden behind the occluders rendered into occlusion.
+    void cull(SoftwareOcclusion &occlusion) {
+        worldBounds.clear();
+        for (const Draw &draw : draws) worldBounds.push_back(draw.bounds);
+        occlusion.cull(worldBounds, visible);
+        keep(visible);
+    }
+    // Draws dropped by cull() since clear().
+    size_t culled() const { return lastCulled; }
+    size_t size() const { return draws.size(); }
+    // Multi-draw calls issued by the last draw().
+    size_t calls() const { return lastCalls; }
+
+    void draw(Shader &shader) {
+        prepare();
+        submit(shader);
+    }
+    void draw(ShaderVariants &variants) {
+        prepare();
+        submit(variants);
+    }
+
+    // draw() in two steps, so the uploaded commands can be edited on the
+    // GPU in between, e.g. by HiZCuller::cull().
+    void prepare() {
+        if (draws.empty()) return;
+        std::stable_sort(draws.begin(), draws.end(),
+                         [](const Draw &a, const Draw &b) {
+                             return a.group() < b.group();
+                         });
+        std::vector<DrawElementsIndirectCommand> commands(draws.size());
+        std::vector<DrawData> data(draws.size());
+        std::vector<DrawBounds> bounds(draws.size());
+        for (size_t i = 0; i < draws.size(); i++) {
+            commands[i] = draws[i].command;
+            commands[i].baseInstance = i;
+            data[i] = draws[i].data;
+            bounds[i] = {glm::vec4(draws[i].bounds.min, 0.0f),
+                         glm::vec4(draws[i].bounds.max, 0.0f)};
+        }
+        upload(commands, data, bounds);
+    }
+    void submit(Shader &shader) {
+        submitWith([&](std::uint32_t) -> Shader & { return shader; });
+    }
+    // Every material is drawn with the variant its textures need.
+    void submit(ShaderVariants &variants) {
+        submitWith([&](std::uint32_t material) -> Shader & {
+            return materialMeshes[material]->shader(variants);
+        });
+    }
+
+    // Draws whose instance count is zero in the uploaded commands. Reads
+    // the command buffer back, which stalls; meant for statistics.
+    size_t occluded() const {
+        if (draws.empty()) return 0;
+        std::vector<DrawElementsIndirectCommand> commands(draws.size());
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        GLState::instance().bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        glGetBufferSubData(
+            GL_DRAW_INDIRECT_BUFFER, 0,
+            commands.size() * sizeof(DrawElementsIndirectCommand),
+            commands.data());
+        return std::count_if(commands.begin(), commands.end(),
+                             [](const DrawElementsIndirectCommand &command) {
+                                 return command.instanceCount == 0;
+                             });
+    }
+
+    GLuint getCommandBuffer() const { return commandBuffer; }
+    GLuint getBoundsBuffer() const { return boundsBuffer; }
+
+   private:
+    struct Draw {
+        DrawElementsIndirectCommand command;
+        DrawData data;
+        VertexFormat format;
+        GLenum indexType;
+        Bounds bounds;
+
+        std::uint64_t group() const {
+            return std::uint64_t(format.key()) << 40 |
+                   std::uint64_t(indexSize(indexType)) << 32 | data.material;
+        }
+    };
+
+    std::vector<Draw> draws;
+    CullingSet culling;
+    std::vector<std::uint32_t> visible;
+    std::vector<Bounds> worldBounds;
+    MaterialTable materials;
+    // The first mesh added with each material, which keeps the variant
+    // that material resolves to.
+    std::vector<const Mesh *> materialMeshes;
+    GLuint commandBuffer, dataBuffer, indexBuffer, boundsBuffer;
+    size_t capacity = 0;
+    size_t lastCalls = 0;
+    size_t lastCulled = 0;
+
+    // shaderFor(material) gives the program for a material.
+    template <typename ShaderFor>
+    void submitWith(ShaderFor &&shaderFor) {
+        lastCalls = 0;
+        if (draws.empty()) return;
+        GLState &state = GLState::instance();
+        state.bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAWS_BINDING,
+                             dataBuffer);
+        GeometryArena &arena = GeometryArena::instance();
+        for (size_t first = 0; first < draws.size();) {
+            size_t last = first + 1;
+            while (last < draws.size() &&
+                   draws[last].group() == draws[first].group())
+                last++;
+            const Draw &draw = draws[first];
+            const std::vector<Texture> &textures =
+                materials[draw.data.material];
+            Shader &shader = shaderFor(draw.data.material);
+            shader.use();
+            bindTextures(shader, textures);
+            attach(arena.vao(draw.format));
+            glMultiDrawElementsIndirect(
+                GL_TRIANGLES, draw.indexType,
+                reinterpret_cast<const void *>(
+                    first * sizeof(DrawElementsIndirectCommand)),
+                last - first, 0);
+            lastCalls++;
+            first = last;
+        }
+    }
+
+    void keep(const std::vector<std::uint32_t> &indices) {
+        lastCulled += draws.size() - indices.size();
+        for (size_t i = 0; i < indices.size(); i++)
+            draws[i] = draws[indices[i]];
+        draws.resize(indices.size());
+        culling.keep(indices);
+    }
+
+    void upload(const std::vector<DrawElementsIndirectCommand> &commands,
+                const std::vector<DrawData> &data,
+                const std::vector<DrawBounds> &bounds) {
+        GLState &state = GLState::instance();
+        if (commands.size() > capacity) {
+            capacity = commands.size() + commands.size() / 2;
+            state.bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+            glBufferData(GL_DRAW_INDIRECT_BUFFER,
+                         capacity * sizeof(DrawElementsIndirectCommand),
+                         nullptr, GL_STREAM_DRAW);
+            state.bindBuffer(GL_SHADER_STORAGE_BUFFER, dataBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, capacity * sizeof(DrawData),
+                         nullptr, GL_STREAM_DRAW);
+            state.bindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,
+                         capacity * sizeof(DrawBounds), nullptr,
+                         GL_STREAM_DRAW);
+            // Draw i reads element i through its baseInstance.
+            std::vector<GLuint> indices(capacity);
+            for (size_t i = 0; i < capacity; i++) indices[i] = i;
+            state.bindBuffer(GL_ARRAY_BUFFER, indexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(GLuint),
+                         indices.data(), GL_STATIC_DRAW);
+        }
+        state.bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0,
+                        commands.size() * sizeof(DrawElementsIndirectCommand),
+                        commands.data());
+        state.bindBuffer(GL_SHADER_STORAGE_BUFFER, dataBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                        data.size() * sizeof(DrawData), data.data());
+        state.bindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                        bounds.size() * sizeof(DrawBounds), bounds.data());
+    }
+
+    void attach(GLuint vao) {
+        GLState &state = GLState::instance();
+        state.bindVertexArray(vao);
+        state.bindBuffer(GL_ARRAY_BUFFER, indexBuffer);
+        glVertexAttribIPointer(DRAW_INDEX_LOCATION, 1, GL_UNSIGNED_INT,
+                               sizeof(GLuint), 0);
+        glVertexAttribDivisor(DRAW_INDEX_LOCATION, 1);
+        glEnableVertexAttribArray(DRAW_INDEX_LOCATION);
+    }
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef INSTANCE_BATCH_H
+#define INSTANCE_BATCH_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <gl_state.h>
+
+#include <cstddef>
+#include <vector>
+
+struct InstanceData {
+    glm::mat4 model;
+    glm::mat3 normalModel;
+};
+
+// Per-instance transforms for drawing many copies of the same geometry with
+// a single instanced call. The attributes occupy locations 3-6 (model) and
+// 7-9 (normalModel), see shaders/instanced.vert.
+class InstanceBatch {
+   public:
+    static constexpr GLuint MODEL_LOCATION = 3;
+    static constexpr GLuint NORMAL_MODEL_LOCATION = 7;
+
+    std::vector<InstanceData> instances;
+
+    InstanceBatch() { glGenBuffers(1, &vbo); }
+    InstanceBatch(const InstanceBatch &) = delete;
+    InstanceBatch &operator=(const InstanceBatch &) = delete;
+
+    void clear() {
+        instances.clear();
+        dirty = true;
+    }
+    void add(const glm::mat4 &model) {
+        instances.push_back(
+            {model, glm::mat3(glm::transpose(glm::inverse(model)))});
+        dirty = true;
+    }
+    void set(size_t index, const glm::mat4 &model) {
+        instances[index] = {model,
+                            glm::mat3(glm::transpose(glm::inverse(model)))};
+        dirty = true;
+    }
+    GLsizei size() const { return instances.size(); }
+
+    void drawArrays(GLuint vao, GLint first, GLsizei count) {
+        if (instances.empty()) return;
+        attach(vao);
+        glDrawArraysInstanced(GL_TRIANGLES, first, count, size());
+    }
+    void drawElements(GLuint vao, GLsizei count, GLenum type,
+                      const void *offset = 0, GLint baseVertex = 0) {
+        if (instances.empty()) return;
+        attach(vao);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, count, type, offset,
+                                          size(), baseVertex);
+    }
+
+   private:
+    unsigned int vbo;
+    size_t capacity = 0;
+    bool dirty = true;
+
+    void upload() {
+        GLState::instance().bindBuffer(GL_ARRAY_BUFFER, vbo);
+        size_t bytes = instances.size() * sizeof(InstanceData);
+        if (instances.size() > capacity) {
+            capacity = instances.size() + instances.size() / 2;
+            glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(InstanceData),
+                         nullptr, GL_STREAM_DRAW);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, instances.data());
+        dirty = false;
+    }
+    void attach(GLuint vao) {
+        GLState::instance().bindVertexArray(vao);
+        if (dirty)
+            upload();
+        else
+            GLState::instance().bindBuffer(GL_ARRAY_BUFFER, vbo);
+        for (GLuint i = 0; i < 4; i++) {
+            GLuint location = MODEL_LOCATION + i;
+            glVertexAttribPointer(
+                location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                (const void *)(offsetof(InstanceData, model) +
+                               i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(location, 1);
+            glEnableVertexAttribArray(location);
+        }
+        for (GLuint i = 0; i < 3; i++) {
+            GLuint location = NORMAL_MODEL_LOCATION + i;
+            glVertexAttribPointer(
+                location, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                (const void *)(offsetof(InstanceData, normalModel) +
+                               i * sizeof(glm::vec3)));
+            glVertexAttribDivisor(location, 1);
+            glEnableVertexAttribArray(location);
+        }
+    }
+};
+
+#endif
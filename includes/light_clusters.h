@@ -0,0 +1,189 @@
+#ifndef LIGHT_CLUSTERS_H
+#define LIGHT_CLUSTERS_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <gl_state.h>
+#include <lights.h>
+#include <shader.h>
+#include <uniform_buffer.h>
+
+#include <cmath>
+#include <vector>
+
+// Clustered forward shading. The view frustum is split into froxels, screen
+// tiles cut by exponentially spaced depth slices, and a compute pass lists
+// the point lights whose range reaches each one. Lit fragments then shade
+// with the lights of their own cluster only. Per frame:
+//
+//     clusters.update(pointLights);
+//     clusters.assign(view, projection, width, height, lights);
+//     lightsBuffer.update(lights);
+class LightClusters {
+   public:
+    static constexpr GLuint CLUSTERS_X = 16;
+    static constexpr GLuint CLUSTERS_Y = 9;
+    static constexpr GLuint CLUSTERS_Z = 24;
+    static constexpr GLuint CLUSTERS = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+    static constexpr GLuint GROUP_SIZE = 128;
+
+    // A light's range ends where it falls below this fraction of its full
+    // intensity.
+    static inline float cutoff = 1.0f / 256.0f;
+
+    LightClusters()
+        : assignShader("./shaders/cluster_lights.comp",
+                       {{"GROUP_SIZE", GROUP_SIZE},
+                        {"MAX_CLUSTER_LIGHTS", MAX_CLUSTER_LIGHTS}}) {
+        glGenBuffers(1, &lightBuffer);
+        glGenBuffers(1, &boundsBuffer);
+        glGenBuffers(1, &countBuffer);
+        glGenBuffers(1, &indexBuffer);
+        GLState &state = GLState::instance();
+        state.bindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     CLUSTERS * sizeof(ClusterBounds), nullptr, GL_STATIC_DRAW);
+        state.bindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, CLUSTERS * sizeof(GLuint),
+                     nullptr, GL_DYNAMIC_COPY);
+        state.bindBuffer(GL_SHADER_STORAGE_BUFFER, indexBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     CLUSTERS * MAX_CLUSTER_LIGHTS * sizeof(GLuint), nullptr,
+                     GL_DYNAMIC_COPY);
+    }
+    ~LightClusters() {
+        GLState &state = GLState::instance();
+        state.deleteBuffer(lightBuffer);
+        state.deleteBuffer(boundsBuffer);
+        state.deleteBuffer(countBuffer);
+        state.deleteBuffer(indexBuffer);
+    }
+    LightClusters(const LightClusters &) = delete;
+    LightClusters &operator=(const LightClusters &) = delete;
+
+    // Upload this frame's point lights, with their ranges filled in.
+    void update(std::vector<PointLight> &pointLights) {
+        for (PointLight &light : pointLights)
+            light.radius = lightRange(light, cutoff);
+        lightCount = pointLights.size();
+        GLState &state = GLState::instance();
+        state.bindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer);
+        size_t size = pointLights.size() * sizeof(PointLight);
+        if (size > lightCapacity) {
+            lightCapacity = size;
+            glBufferData(GL_SHADER_STORAGE_BUFFER, size, pointLights.data(),
+                         GL_DYNAMIC_DRAW);
+        } else if (size) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size,
+                            pointLights.data());
+        }
+    }
+
+    // Bin the uploaded lights into the clusters of a width x height view
+    // and fill in the cluster fields of lights. The projection must be a
+    // perspective one.
+    void assign(const glm::mat4 &view, const glm::mat4 &projection, int width,
+                int height, LightsBlock &lights) {
+        if (projection != lastProjection || width != this->width ||
+            height != this->height)
+            buildClusters(projection, width, height);
+
+        float scale = CLUSTERS_Z / std::log(zFar / zNear);
+        lights.clusterGrid =
+            glm::uvec4(CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z, lightCount);
+        lights.clusterScale =
+            glm::vec4(tileSize, scale, -std::log(zNear) * scale);
+
+        GLState &state = GLState::instance();
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, POINT_LIGHTS_BINDING,
+                             lightBuffer);
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_BOUNDS_BINDING,
+                             boundsBuffer);
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_COUNTS_BINDING,
+                             countBuffer);
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHTS_BINDING,
+                             indexBuffer);
+        assignShader.use();
+        assignShader.set("view", view);
+        assignShader.set("lightCount", int(lightCount));
+        assignShader.set("clusterCount", int(CLUSTERS));
+        glDispatchCompute((CLUSTERS + GROUP_SIZE - 1) / GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    size_t size() const { return lightCount; }
+    // Light count of every cluster, read back from the GPU.
+    std::vector<GLuint> counts() const {
+        std::vector<GLuint> result(CLUSTERS);
+        GLState::instance().bindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                           CLUSTERS * sizeof(GLuint), result.data());
+        return result;
+    }
+
+   private:
+    // Mirrors ClusterBounds in shaders/cluster_lights.comp.
+    struct ClusterBounds {
+        glm::vec4 min;
+        glm::vec4 max;
+    };
+
+    Shader assignShader;
+    GLuint lightBuffer = 0, boundsBuffer = 0, countBuffer = 0,
+           indexBuffer = 0;
+    size_t lightCapacity = 0, lightCount = 0;
+    glm::mat4 lastProjection = glm::mat4(0.0f);
+    int width = 0, height = 0;
+    float zNear = 0.0f, zFar = 0.0f;
+    glm::vec2 tileSize = glm::vec2(0.0f);
+
+    // View space bounds of every cluster; they only change with the
+    // projection and the viewport.
+    void buildClusters(const glm::mat4 &projection, int width, int height) {
+        lastProjection = projection;
+        this->width = width;
+        this->height = height;
+        zNear = projection[3][2] / (projection[2][2] - 1.0f);
+        zFar = projection[3][2] / (projection[2][2] + 1.0f);
+        tileSize = glm::ceil(glm::vec2(width, height) /
+                             glm::vec2(CLUSTERS_X, CLUSTERS_Y));
+
+        // Corners of each tile on the near plane; the froxel scales them
+        // out to its slice depths.
+        glm::mat4 inverse = glm::inverse(projection);
+        auto corner = [&](GLuint x, GLuint y) {
+            glm::vec2 ndc =
+                glm::vec2(x, y) * tileSize / glm::vec2(width, height) * 2.0f -
+                1.0f;
+            glm::vec4 point = inverse * glm::vec4(ndc, -1.0f, 1.0f);
+            return glm::vec3(point) / point.w / zNear;
+        };
+        auto slice = [&](GLuint z) {
+            return zNear * std::pow(zFar / zNear, float(z) / CLUSTERS_Z);
+        };
+        std::vector<ClusterBounds> bounds(CLUSTERS);
+        for (GLuint z = 0; z < CLUSTERS_Z; z++) {
+            float depths[2] = {slice(z), slice(z + 1)};
+            for (GLuint y = 0; y < CLUSTERS_Y; y++) {
+                for (GLuint x = 0; x < CLUSTERS_X; x++) {
+                    glm::vec3 min = corner(x, y) * depths[0], max = min;
+                    for (int i = 0; i < 8; i++) {
+                        glm::vec3 point =
+                            corner(x + (i & 1), y + (i >> 1 & 1)) *
+                            depths[i >> 2];
+                        min = glm::min(min, point);
+                        max = glm::max(max, point);
+                    }
+                    bounds[x + CLUSTERS_X * (y + CLUSTERS_Y * z)] = {
+                        glm::vec4(min, 0.0f), glm::vec4(max, 0.0f)};
+                }
+            }
+        }
+        GLState::instance().bindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                        CLUSTERS * sizeof(ClusterBounds), bounds.data());
+    }
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <glm/glm.hpp>
+#include <limits>
+
+#define MAX_CLUSTER_LIGHTS 1024
+// Shadow cascades of the directed light.
+#define MAX_CASCADES 4
+
+// Mirrors the std430 PointLight struct of the point light storage buffer
+// in shaders/lighting.glsl. radius is filled in by LightClusters, shadow,
+// the first of the light's six shadow atlas tiles or -1, by ShadowAtlas.
+struct PointLight {
+    alignas(16) glm::vec3 position;
+    float radius;
+    alignas(16) glm::vec3 ambient;
+    int shadow = -1;
+    alignas(16) glm::vec3 diffuse;
+    alignas(16) glm::vec3 specular;
+    alignas(16) glm::vec3 coefficients;
+};
+
+// These mirror the std140 "Lights" block in shaders/lighting.glsl: every
+// vec3 starts on a 16 byte boundary, scalars may fill the tail of a vec3.
+struct DirectedLight {
+    alignas(16) glm::vec3 direction;
+    alignas(16) glm::vec3 ambient;
+    alignas(16) glm::vec3 diffuse;
+    alignas(16) glm::vec3 specular;
+};
+
+struct SpotLight {
+    alignas(16) glm::vec3 position;
+    alignas(16) glm::vec3 direction;
+    alignas(16) glm::vec3 ambient;
+    alignas(16) glm::vec3 diffuse;
+    alignas(16) glm::vec3 specular;
+    alignas(16) glm::vec3 coefficients;
+    float cutoff;
+    float outerCutoff;
+    // Shadow atlas tile or -1, set by ShadowAtlas.
+    int shadow = -1;
+};
+
+struct LightsBlock {
+    DirectedLight directedLight;
+    SpotLight spotLight;
+    // Set by LightClusters::assign(): the cluster grid size and the point
+    // light count, then the tile size in pixels and the scale and bias
+    // taking log view depth to a depth slice.
+    glm::uvec4 clusterGrid;
+    glm::vec4 clusterScale;
+    // Set by CascadedShadows::apply(): world to shadow map coordinates of
+    // every cascade, the view depth where each ends, 0 when unused, and
+    // the world size of their texels.
+    glm::mat4 cascadeMatrices[MAX_CASCADES];
+    glm::vec4 cascadeSplits;
+    glm::vec4 cascadeTexels;
+};
+
+static_assert(offsetof(PointLight, radius) == 12);
+static_assert(offsetof(PointLight, shadow) == 28);
+static_assert(sizeof(PointLight) == 80);
+static_assert(sizeof(DirectedLight) == 64);
+static_assert(offsetof(SpotLight, cutoff) == 92);
+static_assert(offsetof(SpotLight, shadow) == 100);
+static_assert(sizeof(SpotLight) == 112);
+static_assert(offsetof(LightsBlock, clusterGrid) == 176);
+static_assert(offsetof(LightsBlock, cascadeMatrices) == 208);
+static_assert(sizeof(LightsBlock) == 496);
+
+// Distance at which the attenuation of light, a PointLight or SpotLight,
+// brings its brightest term below cutoff. Lights without distance falloff
+// never end.
+template <typename Light>
+inline float lightRange(const Light &light, float cutoff) {
+    glm::vec3 peak = light.ambient + light.diffuse + light.specular;
+    float target = std::max(peak.x, std::max(peak.y, peak.z)) / cutoff;
+    const glm::vec3 &k = light.coefficients;
+    if (target <= k.x) return 0.0f;
+    if (k.z > 0.0f)
+        return (-k.y + std::sqrt(k.y * k.y + 4.0f * k.z * (target - k.x))) /
+               (2.0f * k.z);
+    if (k.y > 0.0f) return (target - k.x) / k.y;
+    return std::numeric_limits<float>::infinity();
+}
+
+#endif
@@ -1,19 +1,33 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <algorithm>
+#include <cstdint>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 #include <glm/glm.hpp>
 
+#include <frustum.h>
+#include <geometry_arena.h>
+#include <gl_state.h>
+#include <instance_batch.h>
 #include <shader.h>
+#include <shader_variants.h>
+#include <vertex_format.h>
 
 enum TextureType { DIFFUSE, SPECULAR };
 
-struct Vertex {
-    glm::vec3 position;
-    glm::vec3 normal;
-    glm::vec2 texCoords;
-};
+inline Bounds computeBounds(const Vertex *vertices, size_t count) {
+    if (count == 0) return {glm::vec3(0.0f), glm::vec3(0.0f)};
+    Bounds bounds = {vertices[0].position, vertices[0].position};
+    for (size_t i = 1; i < count; i++) {
+        bounds.min = glm::min(bounds.min, vertices[i].position);
+        bounds.max = glm::max(bounds.max, vertices[i].position);
+    }
+    return bounds;
+}
 
 struct Texture {
     unsigned int id;
@@ -21,65 +35,202 @@ struct Texture {
     std::string path;
 };
 
+struct TextureRef {
+    TextureType type;
+    std::string path;
+};
+
+// Binds textures to consecutive units and points the numbered
+// material.diffuseN/material.specularN samplers at them.
+inline void bindTextures(Shader &shader,
+                         const std::vector<Texture> &textures) {
+    const MaterialUniforms &samplers = shader.materialUniforms();
+    size_t diffuseIndex = 0;
+    size_t specularIndex = 0;
+
+    for (size_t i = 0; i < textures.size(); ++i) {
+        bool diffuse = textures[i].type == DIFFUSE;
+        const std::vector<Uniform<int>> &uniforms =
+            diffuse ? samplers.diffuse : samplers.specular;
+        size_t &index = diffuse ? diffuseIndex : specularIndex;
+        if (index < uniforms.size()) shader.set(uniforms[index], int(i));
+        index++;
+
+        GLState::instance().bindTexture(i, GL_TEXTURE_2D, textures[i].id);
+    }
+}
+
+// Features the shader needs for a material made of textures; pass them to
+// ShaderVariants::get() for the cheapest variant that draws it.
+inline ShaderDefines materialDefines(const std::vector<Texture> &textures) {
+    bool specular = std::any_of(
+        textures.begin(), textures.end(),
+        [](const Texture &texture) { return texture.type == SPECULAR; });
+    return {{"HAS_SPECULAR_MAP", specular}};
+}
+
+// The texture sets of a frame's draws, numbered so draws can be grouped
+// by them. Meshes with the same textures share a material.
+class MaterialTable {
+   public:
+    void clear() {
+        materials.clear();
+        index.clear();
+    }
+    std::uint32_t add(const std::vector<Texture> &textures) {
+        std::vector<std::pair<unsigned int, int>> key;
+        for (const Texture &texture : textures)
+            key.push_back({texture.id, texture.type});
+        auto [it, inserted] = index.try_emplace(key, materials.size());
+        if (inserted) materials.push_back(textures);
+        return it->second;
+    }
+    const std::vector<Texture> &operator[](std::uint32_t material) const {
+        return materials[material];
+    }
+    size_t size() const { return materials.size(); }
+
+   private:
+    std::vector<std::vector<Texture>> materials;
+    std::map<std::vector<std::pair<unsigned int, int>>, std::uint32_t> index;
+};
+
+// CPU side of a mesh, as produced by importModel.
+struct MeshData {
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<TextureRef> textures;
+    VertexFormat format;
+};
+
+struct ModelData {
+    std::string directory;
+    std::vector<MeshData> meshes;
+};
+
+// A mesh already in its GPU layout, in memory owned by someone else, e.g.
+// a mapped mesh cache: vertices packed in format and indices of
+// indexType.
+struct PackedMesh {
+    const void *vertices;
+    size_t vertexCount;
+    VertexFormat format;
+    const void *indices;
+    size_t indexCount;
+    GLenum indexType;
+    Bounds bounds;
+    Sphere sphere;
+};
+
 class Mesh {
    public:
     std::vector<Vertex> vertices;
     std::vector<unsigned int> indices;
     std::vector<Texture> textures;
+    Bounds bounds;
+    Sphere sphere;
+    VertexFormat format;
+    // Where the mesh lives in the shared GeometryArena buffers.
+    GeometryArena::Allocation geometry;
+
+    static inline bool byteIndices = false;
+    // Split imported meshes so every part fits 16-bit indices.
+    static inline bool splitLargeMeshes = true;
 
     Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices,
-         std::vector<Texture> textures)
-        : vertices(vertices), indices(indices), textures(textures) {
-        setup();
+         std::vector<Texture> textures, VertexFormat format = {})
+        : vertices(std::move(vertices)),
+          indices(std::move(indices)),
+          textures(std::move(textures)),
+          format(format) {
+        bounds = computeBounds(this->vertices.data(), this->vertices.size());
+        sphere = boundingSphere(this->vertices.data(), this->vertices.size(),
+                                bounds);
+        setup(this->vertices.data(), this->vertices.size(),
+              this->indices.data(), this->indices.size());
+    }
+    // Uploads straight from packed's memory without any intermediate copy;
+    // vertices and indices stay empty.
+    Mesh(const PackedMesh &packed, std::vector<Texture> textures)
+        : textures(std::move(textures)),
+          bounds(packed.bounds),
+          sphere(packed.sphere),
+          format(packed.format) {
+        geometry = GeometryArena::instance().allocate(
+            format, packed.vertices, packed.vertexCount, packed.indexType,
+            packed.indices, packed.indexCount);
     }
 
     void draw(Shader &shader) {
-        unsigned int diffuseIndex = 0;
-        unsigned int specularIndex = 0;
-
-        for (int i = 0; i < textures.size(); ++i) {
-            glActiveTexture(GL_TEXTURE0 + i);
-            std::string index;
-            TextureType type = textures[i].type;
-            if (type == DIFFUSE) index = std::to_string(diffuseIndex++);
-            if (type == SPECULAR) index = std::to_string(specularIndex++);
-
-            shader.set("material." + type + index, i);
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
-        }
-        glActiveTexture(GL_TEXTURE0);
+        bindTextures(shader, textures);
+        setDequantization(shader);
+        GLState::instance().bindVertexArray(
+            GeometryArena::instance().vao(format));
+        glDrawElementsBaseVertex(GL_TRIANGLES, geometry.indexCount,
+                                 geometry.indexType, geometry.indexOffset(),
+                                 geometry.baseVertex);
+    }
+    void draw(Shader &shader, InstanceBatch &batch) {
+        bindTextures(shader, textures);
+        setDequantization(shader);
+        batch.drawElements(GeometryArena::instance().vao(format),
+                           geometry.indexCount, geometry.indexType,
+                           geometry.indexOffset(), geometry.baseVertex);
+    }
+
+    // The variant of variants this mesh's material needs. Resolved once and
+    // reused until another set is asked for or ShaderVariants::revision()
+    // moves on.
+    Shader &shader(ShaderVariants &variants) const {
+        if (resolved.variants != &variants ||
+            resolved.revision != ShaderVariants::revision())
+            resolved = {&variants, ShaderVariants::revision(),
+                        &variants.get(materialDefines(textures))};
+        return *resolved.shader;
+    }
 
-        glBindVertexArray(vao);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+    // Meshes are copied around freely, so the owner returns the geometry
+    // to the arena once, when the last copy is done with it.
+    void release() {
+        GeometryArena::instance().release(geometry);
+        geometry = {};
+    }
+
+    void setDequantization(Shader &shader) const {
+        const ObjectUniforms &object = shader.objectUniforms();
+        shader.set(object.positionScale,
+                   VertexFormat::positionScale(format, bounds));
+        shader.set(object.positionOffset,
+                   VertexFormat::positionOffset(format, bounds));
+        shader.set(object.octahedralNormals,
+                   int(format.normal == NORMAL_OCTAHEDRAL));
     }
 
    private:
-    unsigned int vao, vbo, ebo;
-    void setup() {
-        glGenBuffers(1, &vbo);
-        glGenVertexArrays(1, &vao);
-        glGenBuffers(1, &ebo);
-
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
-                     &vertices[0], GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                     indices.size() * sizeof(unsigned int), &indices[0],
-                     GL_STATIC_DRAW);
-
-        glBindVertexArray(vao);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (const void *)offsetof(Vertex, normal));
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
-                              (const void *)offsetof(Vertex, texCoords));
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
-        glEnableVertexAttribArray(2);
-
-        glBindVertexArray(0);
+    struct ResolvedVariant {
+        const ShaderVariants *variants = nullptr;
+        unsigned revision = 0;
+        Shader *shader = nullptr;
+    };
+    mutable ResolvedVariant resolved;
+
+    void setup(const Vertex *vertices, size_t vertexCount,
+               const unsigned int *indices, size_t count) {
+        GLenum indexType = indexTypeFor(vertexCount, byteIndices);
+        std::vector<unsigned char> packed, narrowed;
+        const void *vertexData = vertices;
+        const void *indexData = indices;
+        if (format != VertexFormat()) {
+            packed.resize(vertexCount * format.stride());
+            format.pack(vertices, vertexCount, bounds, packed.data());
+            vertexData = packed.data();
+        }
+        if (indexType != GL_UNSIGNED_INT) {
+            narrowed = narrowIndices(indices, count, indexType);
+            indexData = narrowed.data();
+        }
+        geometry = GeometryArena::instance().allocate(
+            format, vertexData, vertexCount, indexType, indexData, count);
     }
 };
 
@@ -0,0 +1,278 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <mapped_file.h>
+#include <mesh.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Baked, already-processed mesh streams. Layout of a .meshcache file:
+//   MeshCacheHeader
+//   MeshCacheEntry[meshCount]
+//   MeshCacheTexture[textureCount]
+//   texture path strings
+//   per mesh, 16 byte aligned: vertexCount vertices packed in the mesh's
+//   VertexFormat, then indexCount indices of indexType
+// Everything is little-endian and uploaded in place from a memory mapping.
+#define MESH_CACHE_VERSION 3
+
+struct MeshCacheHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t meshCount;
+    std::uint32_t textureCount;
+    std::uint64_t stringOffset;
+    std::uint64_t stringSize;
+};
+
+struct MeshCacheEntry {
+    std::uint64_t vertexOffset;
+    std::uint64_t indexOffset;
+    std::uint32_t vertexCount;
+    std::uint32_t indexCount;
+    std::uint32_t firstTexture;
+    std::uint32_t textureCount;
+    Bounds bounds;
+    std::uint32_t format;  // VertexFormat::key()
+    Sphere sphere;
+    std::uint32_t indexType;  // GL_UNSIGNED_BYTE, _SHORT or _INT
+};
+
+struct MeshCacheTexture {
+    std::uint32_t type;
+    std::uint32_t pathOffset;
+    std::uint32_t pathLength;
+};
+
+static_assert(std::is_trivially_copyable_v<MeshCacheEntry>);
+
+class MeshCache {
+   public:
+    static inline bool enabled = true;
+
+    static std::string pathFor(const std::string &source) {
+        return source + ".meshcache";
+    }
+    // A cache is usable when it is at least as new as its source, or when
+    // only the baked file was shipped.
+    static bool isFresh(const std::string &source) {
+        std::error_code error;
+        auto cacheTime =
+            std::filesystem::last_write_time(pathFor(source), error);
+        if (error) return false;
+        auto sourceTime = std::filesystem::last_write_time(source, error);
+        return error || cacheTime >= sourceTime;
+    }
+
+    static bool write(const std::string &file, const ModelData &model) {
+        MeshCacheHeader header{};
+        std::memcpy(header.magic, "MSHC", 4);
+        header.version = MESH_CACHE_VERSION;
+        header.meshCount = model.meshes.size();
+        std::vector<MeshCacheEntry> entries(model.meshes.size());
+        std::vector<MeshCacheTexture> textures;
+        std::string strings;
+        for (size_t i = 0; i < model.meshes.size(); i++) {
+            const MeshData &mesh = model.meshes[i];
+            entries[i].vertexCount = mesh.vertices.size();
+            entries[i].indexCount = mesh.indices.size();
+            entries[i].firstTexture = textures.size();
+            entries[i].textureCount = mesh.textures.size();
+            entries[i].bounds =
+                computeBounds(mesh.vertices.data(), mesh.vertices.size());
+            entries[i].format = mesh.format.key();
+            entries[i].sphere =
+                boundingSphere(mesh.vertices.data(), mesh.vertices.size(),
+                               entries[i].bounds);
+            entries[i].indexType =
+                indexTypeFor(mesh.vertices.size(), Mesh::byteIndices);
+            for (const TextureRef &ref : mesh.textures) {
+                textures.push_back({static_cast<std::uint32_t>(ref.type),
+                                    static_cast<std::uint32_t>(strings.size()),
+                                    static_cast<std::uint32_t>(
+                                        ref.path.size())});
+                strings += ref.path;
+            }
+        }
+        header.textureCount = textures.size();
+        header.stringOffset = sizeof(MeshCacheHeader) +
+                              entries.size() * sizeof(MeshCacheEntry) +
+                              textures.size() * sizeof(MeshCacheTexture);
+        header.stringSize = strings.size();
+
+        std::uint64_t offset = align(header.stringOffset + strings.size());
+        for (size_t i = 0; i < model.meshes.size(); i++) {
+            entries[i].vertexOffset = offset;
+            offset = align(offset + std::uint64_t(entries[i].vertexCount) *
+                                        model.meshes[i].format.stride());
+            entries[i].indexOffset = offset;
+            offset = align(offset + std::uint64_t(entries[i].indexCount) *
+                                        indexSize(entries[i].indexType));
+        }
+
+        // Write next to the target and rename, so a reader never maps a
+        // half-written file. The random suffix keeps writers of the same
+        // model, in this process or another, out of each other's way.
+        char suffix[16];
+        std::snprintf(suffix, sizeof(suffix), ".%08x.tmp",
+                      static_cast<unsigned int>(std::random_device{}()));
+        std::string temporary = file + suffix;
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            if (!out) {
+                std::cerr << "ERROR WRITING MESH CACHE: " << file << std::endl;
+                return false;
+            }
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(entries.data()),
+                      entries.size() * sizeof(MeshCacheEntry));
+            out.write(reinterpret_cast<const char *>(textures.data()),
+                      textures.size() * sizeof(MeshCacheTexture));
+            out.write(strings.data(), strings.size());
+            std::vector<unsigned char> packed, narrowed;
+            for (size_t i = 0; i < model.meshes.size(); i++) {
+                const MeshData &mesh = model.meshes[i];
+                packed.resize(mesh.vertices.size() * mesh.format.stride());
+                mesh.format.pack(mesh.vertices.data(), mesh.vertices.size(),
+                                 entries[i].bounds, packed.data());
+                narrowed = narrowIndices(mesh.indices.data(),
+                                         mesh.indices.size(),
+                                         entries[i].indexType);
+                pad(out, entries[i].vertexOffset);
+                out.write(reinterpret_cast<const char *>(packed.data()),
+                          packed.size());
+                pad(out, entries[i].indexOffset);
+                out.write(reinterpret_cast<const char *>(narrowed.data()),
+                          narrowed.size());
+            }
+            if (!out) {
+                std::cerr << "ERROR WRITING MESH CACHE: " << file << std::endl;
+                out.close();
+                std::error_code ignored;
+                std::filesystem::remove(temporary, ignored);
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, file, error);
+        bool renamed = !error;
+        if (!renamed) {
+            std::cerr << "ERROR WRITING MESH CACHE: " << file << std::endl;
+            std::error_code ignored;
+            std::filesystem::remove(temporary, ignored);
+        }
+        return renamed;
+    }
+
+    bool open(const std::string &path) {
+        if (!file.open(path)) return false;
+        if (!validate()) {
+            std::cerr << "ERROR INVALID MESH CACHE: " << path << std::endl;
+            file.close();
+            return false;
+        }
+        return true;
+    }
+    void close() { file.close(); }
+    bool isOpen() const { return file.data() != nullptr; }
+
+    size_t size() const { return header()->meshCount; }
+    // Points into the mapping, which must stay open until it is uploaded.
+    PackedMesh mesh(size_t mesh) const {
+        const MeshCacheEntry &e = entry(mesh);
+        return {file.data() + e.vertexOffset,
+                e.vertexCount,
+                VertexFormat::fromKey(e.format),
+                file.data() + e.indexOffset,
+                e.indexCount,
+                e.indexType,
+                e.bounds,
+                e.sphere};
+    }
+    std::vector<TextureRef> textures(size_t mesh) const {
+        std::vector<TextureRef> refs;
+        const MeshCacheTexture *records =
+            reinterpret_cast<const MeshCacheTexture *>(
+                file.data() + sizeof(MeshCacheHeader) +
+                size() * sizeof(MeshCacheEntry));
+        const char *strings = file.data() + header()->stringOffset;
+        for (std::uint32_t i = 0; i < entry(mesh).textureCount; i++) {
+            const MeshCacheTexture &record =
+                records[entry(mesh).firstTexture + i];
+            refs.push_back({static_cast<TextureType>(record.type),
+                            std::string(strings + record.pathOffset,
+                                        record.pathLength)});
+        }
+        return refs;
+    }
+
+   private:
+    MappedFile file;
+
+    static std::uint64_t align(std::uint64_t offset) {
+        return (offset + 15) & ~std::uint64_t(15);
+    }
+    static void pad(std::ofstream &out, std::uint64_t offset) {
+        while (static_cast<std::uint64_t>(out.tellp()) < offset) out.put(0);
+    }
+
+    const MeshCacheHeader *header() const {
+        return reinterpret_cast<const MeshCacheHeader *>(file.data());
+    }
+    const MeshCacheEntry &entry(size_t mesh) const {
+        return reinterpret_cast<const MeshCacheEntry *>(
+            file.data() + sizeof(MeshCacheHeader))[mesh];
+    }
+    bool validate() const {
+        if (file.size() < sizeof(MeshCacheHeader)) return false;
+        const MeshCacheHeader *h = header();
+        if (std::memcmp(h->magic, "MSHC", 4) != 0 ||
+            h->version != MESH_CACHE_VERSION)
+            return false;
+        std::uint64_t tables = sizeof(MeshCacheHeader) +
+                               std::uint64_t(h->meshCount) *
+                                   sizeof(MeshCacheEntry) +
+                               std::uint64_t(h->textureCount) *
+                                   sizeof(MeshCacheTexture);
+        if (tables > file.size() || h->stringOffset != tables ||
+            h->stringOffset + h->stringSize > file.size())
+            return false;
+        for (size_t i = 0; i < h->meshCount; i++) {
+            const MeshCacheEntry &e = entry(i);
+            VertexFormat format = VertexFormat::fromKey(e.format);
+            if (format.key() != e.format || !format.valid() ||
+                (e.indexType != GL_UNSIGNED_BYTE &&
+                 e.indexType != GL_UNSIGNED_SHORT &&
+                 e.indexType != GL_UNSIGNED_INT) ||
+                e.vertexOffset + std::uint64_t(e.vertexCount) *
+                                         format.stride() >
+                    file.size() ||
+                e.indexOffset + std::uint64_t(e.indexCount) *
+                                        indexSize(e.indexType) >
+                    file.size() ||
+                e.firstTexture + e.textureCount > h->textureCount)
+                return false;
+        }
+        const MeshCacheTexture *records =
+            reinterpret_cast<const MeshCacheTexture *>(
+                file.data() + sizeof(MeshCacheHeader) +
+                h->meshCount * sizeof(MeshCacheEntry));
+        for (size_t i = 0; i < h->textureCount; i++) {
+            if (std::uint64_t(records[i].pathOffset) + records[i].pathLength >
+                h->stringSize)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif
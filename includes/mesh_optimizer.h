@@ -0,0 +1,335 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <mesh.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Merge bit-identical vertices and rewrite the index buffer to match.
+// Vertices keep the order in which they are first referenced.
+inline void deduplicateVertices(MeshData &mesh) {
+    struct Key {
+        const Vertex *vertex;
+        bool operator==(const Key &other) const {
+            return std::memcmp(vertex, other.vertex, sizeof(Vertex)) == 0;
+        }
+    };
+    struct Hash {
+        size_t operator()(const Key &key) const {
+            std::uint64_t hash = 14695981039346656037ull;
+            auto bytes = reinterpret_cast<const unsigned char *>(key.vertex);
+            for (size_t i = 0; i < sizeof(Vertex); i++) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+    };
+
+    std::unordered_map<Key, unsigned int, Hash> unique;
+    unique.reserve(mesh.vertices.size());
+    std::vector<unsigned int> remap(mesh.vertices.size(), ~0u);
+    std::vector<Vertex> vertices;
+    vertices.reserve(mesh.vertices.size());
+    for (unsigned int &index : mesh.indices) {
+        if (remap[index] == ~0u) {
+            auto [it, inserted] = unique.emplace(
+                Key{&mesh.vertices[index]}, (unsigned int)vertices.size());
+            if (inserted) vertices.push_back(mesh.vertices[index]);
+            remap[index] = it->second;
+        }
+        index = remap[index];
+    }
+    mesh.vertices = std::move(vertices);
+}
+
+// Reorder triangles for a post-transform vertex cache with Tom Forsyth's
+// linear-speed algorithm. Works for any cache size; 32 entries is a good
+// fit for current hardware, which no longer uses a plain FIFO.
+inline void optimizeVertexCache(std::vector<unsigned int> &indices,
+                                size_t vertexCount, int cacheSize = 32) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) return;
+
+    auto vertexScore = [cacheSize](int position, int remaining) {
+        if (remaining == 0) return -1.0f;
+        float score = 0.0f;
+        if (position >= 0) {
+            if (position < 3)
+                score = 0.75f;
+            else
+                score = std::pow(1.0f - float(position - 3) /
+                                            float(cacheSize - 3),
+                                 1.5f);
+        }
+        return score + 2.0f / std::sqrt(float(remaining));
+    };
+
+    // Triangles adjacent to each vertex, as offsets into one flat array.
+    std::vector<unsigned int> offsets(vertexCount + 1, 0);
+    for (unsigned int index : indices) offsets[index + 1]++;
+    for (size_t i = 0; i < vertexCount; i++) offsets[i + 1] += offsets[i];
+    std::vector<unsigned int> adjacency(indices.size());
+    std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++)
+        adjacency[fill[indices[i]]++] = i / 3;
+
+    std::vector<int> remaining(vertexCount), position(vertexCount, -1);
+    std::vector<float> score(vertexCount);
+    for (size_t i = 0; i < vertexCount; i++) {
+        remaining[i] = offsets[i + 1] - offsets[i];
+        score[i] = vertexScore(-1, remaining[i]);
+    }
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<bool> emitted(triangleCount, false);
+    for (size_t t = 0; t < triangleCount; t++)
+        triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] +
+                           score[indices[t * 3 + 2]];
+
+    std::vector<unsigned int> result;
+    result.reserve(indices.size());
+    std::vector<unsigned int> cache, next;
+    size_t scan = 0;
+    while (result.size() < indices.size()) {
+        // Best triangle touching the cache, else the next unemitted one.
+        long best = -1;
+        float bestScore = -1.0f;
+        for (unsigned int vertex : cache) {
+            for (unsigned int i = offsets[vertex];
+                 i < offsets[vertex] + remaining[vertex]; i++) {
+                unsigned int t = adjacency[i];
+                if (triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+        }
+        if (best < 0) {
+            while (emitted[scan]) scan++;
+            best = scan;
+        }
+
+        emitted[best] = true;
+        next.clear();
+        for (int k = 0; k < 3; k++) {
+            unsigned int vertex = indices[best * 3 + k];
+            result.push_back(vertex);
+            if (std::find(next.begin(), next.end(), vertex) == next.end())
+                next.push_back(vertex);
+            remaining[vertex]--;
+            // Drop the triangle from the vertex's live adjacency list.
+            for (unsigned int i = offsets[vertex]; i < offsets[vertex + 1];
+                 i++) {
+                if (adjacency[i] == (unsigned int)best) {
+                    std::swap(adjacency[i],
+                              adjacency[offsets[vertex] + remaining[vertex]]);
+                    break;
+                }
+            }
+        }
+        for (unsigned int vertex : cache) {
+            if (std::find(next.begin(), next.end(), vertex) == next.end())
+                next.push_back(vertex);
+        }
+        std::swap(cache, next);
+
+        // Vertices pushed out of the cache lose their position bonus.
+        for (size_t i = 0; i < cache.size(); i++) {
+            unsigned int vertex = cache[i];
+            position[vertex] = i < size_t(cacheSize) ? int(i) : -1;
+            score[vertex] = vertexScore(position[vertex], remaining[vertex]);
+        }
+        for (unsigned int vertex : cache) {
+            for (unsigned int i = offsets[vertex];
+                 i < offsets[vertex] + remaining[vertex]; i++) {
+                unsigned int t = adjacency[i];
+                triangleScore[t] = score[indices[t * 3]] +
+                                   score[indices[t * 3 + 1]] +
+                                   score[indices[t * 3 + 2]];
+            }
+        }
+        if (cache.size() > size_t(cacheSize)) cache.resize(cacheSize);
+    }
+    indices = std::move(result);
+}
+
+struct VertexCacheStatistics {
+    float acmr;  // transformed vertices per triangle
+    float atvr;  // transformed vertices per unique vertex
+};
+
+// Replays the index buffer through a FIFO post-transform cache.
+inline VertexCacheStatistics analyzeVertexCache(
+    const std::vector<unsigned int> &indices, size_t vertexCount,
+    int cacheSize = 16) {
+    std::vector<size_t> stamp(vertexCount, 0);
+    size_t misses = 0;
+    for (unsigned int index : indices) {
+        // A vertex is cached if fewer than cacheSize misses happened since
+        // it was last loaded.
+        if (stamp[index] == 0 || misses + 1 - stamp[index] > size_t(cacheSize))
+            stamp[index] = ++misses;
+    }
+    size_t triangles = indices.size() / 3;
+    return {triangles ? float(misses) / triangles : 0.0f,
+            vertexCount ? float(misses) / vertexCount : 0.0f};
+}
+
+// Reorder runs of cache-coherent triangles so that outward-facing clusters
+// come first, which approximates front-to-back order from any viewpoint
+// (Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw"). Expects cache-optimized input; the new order is kept only if
+// the ACMR stays within threshold of it.
+inline void optimizeOverdraw(std::vector<unsigned int> &indices,
+                             const std::vector<Vertex> &vertices,
+                             float threshold = 1.05f, int cacheSize = 16) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount < 2) return;
+
+    // Clusters start wherever the cache had to reload a whole triangle.
+    std::vector<size_t> clusters;
+    std::vector<size_t> stamp(vertices.size(), 0);
+    size_t misses = 0;
+    for (size_t t = 0; t < triangleCount; t++) {
+        int triangleMisses = 0;
+        for (int k = 0; k < 3; k++) {
+            unsigned int index = indices[t * 3 + k];
+            if (stamp[index] == 0 ||
+                misses + 1 - stamp[index] > size_t(cacheSize)) {
+                stamp[index] = ++misses;
+                triangleMisses++;
+            }
+        }
+        if (t == 0 || triangleMisses == 3) clusters.push_back(t);
+    }
+    if (clusters.size() < 2) return;
+    clusters.push_back(triangleCount);
+
+    glm::vec3 meshCentroid(0.0f);
+    for (const Vertex &vertex : vertices) meshCentroid += vertex.position;
+    meshCentroid /= float(vertices.size());
+
+    std::vector<float> sortKey(clusters.size() - 1);
+    for (size_t c = 0; c + 1 < clusters.size(); c++) {
+        glm::vec3 centroid(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (size_t t = clusters[c]; t < clusters[c + 1]; t++) {
+            const glm::vec3 &a = vertices[indices[t * 3]].position;
+            const glm::vec3 &b = vertices[indices[t * 3 + 1]].position;
+            const glm::vec3 &d = vertices[indices[t * 3 + 2]].position;
+            glm::vec3 n = glm::cross(b - a, d - a);
+            float weight = glm::length(n);
+            centroid += (a + b + d) * (weight / 3.0f);
+            normal += n;
+            area += weight;
+        }
+        if (area > 0.0f) centroid /= area;
+        float length = glm::length(normal);
+        sortKey[c] = length > 0.0f
+                         ? glm::dot(centroid - meshCentroid, normal / length)
+                         : 0.0f;
+    }
+    std::vector<size_t> order(sortKey.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return sortKey[a] > sortKey[b];
+    });
+
+    std::vector<unsigned int> result;
+    result.reserve(indices.size());
+    for (size_t c : order) {
+        result.insert(result.end(), indices.begin() + clusters[c] * 3,
+                      indices.begin() + clusters[c + 1] * 3);
+    }
+    float before = analyzeVertexCache(indices, vertices.size(), cacheSize).acmr;
+    float after = analyzeVertexCache(result, vertices.size(), cacheSize).acmr;
+    if (after <= before * threshold) indices = std::move(result);
+}
+
+// Renumber vertices in the order the index buffer first touches them, so
+// vertex fetches walk memory linearly. Unreferenced vertices are dropped.
+inline void optimizeVertexFetch(MeshData &mesh) {
+    std::vector<unsigned int> remap(mesh.vertices.size(), ~0u);
+    std::vector<Vertex> vertices;
+    vertices.reserve(mesh.vertices.size());
+    for (unsigned int &index : mesh.indices) {
+        if (remap[index] == ~0u) {
+            remap[index] = vertices.size();
+            vertices.push_back(mesh.vertices[index]);
+        }
+        index = remap[index];
+    }
+    mesh.vertices = std::move(vertices);
+}
+
+// Optional stage run on every imported mesh before it is uploaded or
+// cached. Mesh caches written while it was disabled are used as they are.
+class MeshOptimizer {
+   public:
+    static inline bool enabled = false;
+    static inline bool report = false;
+
+    static void optimize(MeshData &mesh, const std::string &name = "") {
+        size_t vertexCount = mesh.vertices.size();
+        deduplicateVertices(mesh);
+        // Measured on the shared vertices, so only the reordering counts.
+        VertexCacheStatistics before =
+            analyzeVertexCache(mesh.indices, mesh.vertices.size());
+        optimizeVertexCache(mesh.indices, mesh.vertices.size());
+        optimizeOverdraw(mesh.indices, mesh.vertices);
+        optimizeVertexFetch(mesh);
+        if (!report) return;
+        VertexCacheStatistics after =
+            analyzeVertexCache(mesh.indices, mesh.vertices.size());
+        std::cout << "Optimized " << name << ": " << mesh.indices.size() / 3
+                  << " triangles, vertices " << vertexCount << " -> "
+                  << mesh.vertices.size() << ", ACMR " << before.acmr
+                  << " -> " << after.acmr << ", ATVR " << before.atvr
+                  << " -> " << after.atvr << std::endl;
+    }
+};
+
+// Cut a mesh into parts of at most maxVertices vertices each, keeping the
+// triangle order so cache and overdraw ordering survive the split.
+inline std::vector<MeshData> splitMesh(MeshData &mesh,
+                                       size_t maxVertices = 0x10000) {
+    std::vector<MeshData> parts;
+    if (mesh.vertices.size() <= maxVertices) {
+        parts.push_back(std::move(mesh));
+        return parts;
+    }
+    // owner holds the 1-based part a vertex was last copied into.
+    std::vector<unsigned int> remap(mesh.vertices.size());
+    std::vector<size_t> owner(mesh.vertices.size(), 0);
+    for (size_t t = 0; t + 2 < mesh.indices.size(); t += 3) {
+        size_t added = 0;
+        for (int k = 0; k < 3; k++)
+            added += owner[mesh.indices[t + k]] != parts.size();
+        if (parts.empty() ||
+            parts.back().vertices.size() + added > maxVertices) {
+            parts.emplace_back();
+            parts.back().textures = mesh.textures;
+        }
+        MeshData &part = parts.back();
+        for (int k = 0; k < 3; k++) {
+            unsigned int index = mesh.indices[t + k];
+            if (owner[index] != parts.size()) {
+                owner[index] = parts.size();
+                remap[index] = part.vertices.size();
+                part.vertices.push_back(mesh.vertices[index]);
+            }
+            part.indices.push_back(remap[index]);
+        }
+    }
+    return parts;
+}
+
+#endif
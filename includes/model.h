@@ -9,8 +9,16 @@
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+#include <compressed_texture.h>
+#include <gl_state.h>
+#include <indirect_batch.h>
 #include <mesh.h>
+#include <mesh_cache.h>
+#include <mesh_optimizer.h>
+#include <render_queue.h>
 #include <shader.h>
+#include <shader_variants.h>
+#include <texture_cache.h>
 
 #include <string>
 #include <fstream>
@@ -19,128 +27,270 @@
 #include <map>
 #include <vector>
 
-unsigned int importTexture(const char *name, const std::string &path) {
-    std::string file = path + '/' + std::string(name);
+// Either stb-decoded pixels or, for DDS/KTX/KTX2 files, compressed blocks.
+struct ImageData {
+    int width = 0, height = 0, components = 0;
+    unsigned char *pixels = nullptr;
+    CompressedImage compressed;
+
+    bool valid() const { return pixels || !compressed.levels.empty(); }
+};
+
+// Decoding touches no GL state and may run on any thread.
+ImageData decodeImage(const std::string &file) {
+    ImageData image;
+    if (isCompressedImage(file)) {
+        if (readCompressedImage(file, image.compressed)) {
+            image.width = image.compressed.levels[0].width;
+            image.height = image.compressed.levels[0].height;
+        }
+        return image;
+    }
+    image.pixels = stbi_load(file.c_str(), &image.width, &image.height,
+                             &image.components, 0);
+    if (!image.pixels)
+        std::cerr << "ERROR LOADING TEXTURE AT " << file << std::endl;
+    return image;
+}
+
+void freeImage(ImageData &image) {
+    stbi_image_free(image.pixels);
+    image.pixels = nullptr;
+    image.compressed = {};
+}
+
+unsigned int uploadTexture(ImageData &image) {
     unsigned int id;
     glGenTextures(1, &id);
-
-    int width, height, components;
-    unsigned char *data =
-        stbi_load(file.c_str(), &width, &height, &components, 0);
-    if (data) {
-        GLenum format = components == 1   ? GL_RED
-                        : components == 3 ? GL_RGB
-                                          : GL_RGBA;
-        glBindTexture(GL_TEXTURE_2D, id);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
-                     GL_UNSIGNED_BYTE, data);
+    GLState::instance().bindTexture(GL_TEXTURE_2D, id);
+    if (image.pixels) {
+        GLenum format = image.components == 1   ? GL_RED
+                        : image.components == 3 ? GL_RGB
+                                                : GL_RGBA;
+        glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0,
+                     format, GL_UNSIGNED_BYTE, image.pixels);
         glGenerateMipmap(GL_TEXTURE_2D);
+    } else if (!image.compressed.levels.empty())
+        uploadCompressedImage(image.compressed);
+    freeImage(image);
+    return id;
+}
+
+std::uint64_t hashImage(const ImageData &image) {
+    std::uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const unsigned char *data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+    };
+    int header[] = {image.width, image.height, image.components};
+    mix(reinterpret_cast<const unsigned char *>(header), sizeof(header));
+    if (image.pixels)
+        mix(image.pixels,
+            size_t(image.width) * image.height * image.components);
+    else
+        mix(image.compressed.data.data(), image.compressed.data.size());
+    return hash;
+}
+
+// Load a texture through the shared TextureCache. The caller owns one
+// reference and should hand it back with TextureCache::release. Returns 0 if
+// the image could not be decoded.
+unsigned int loadTexture(const std::string &file) {
+    TextureCache &cache = TextureCache::instance();
+    std::string key = TextureCache::normalize(file);
+    if (unsigned int id = cache.acquire(key)) return id;
 
-        stbi_image_free(data);
-    } else {
-        std::cerr << "ERROR LOADING TEXTURE AT " << path << std::endl;
-        stbi_image_free(data);
+    ImageData image = decodeImage(file);
+    if (!image.valid()) return 0;
+    std::uint64_t hash = TextureCache::hashContents ? hashImage(image) : 0;
+    if (unsigned int id = cache.acquire(key, hash)) {
+        freeImage(image);
+        return id;
     }
-    return id;
+    return cache.insert(key, uploadTexture(image), hash);
+}
+
+unsigned int importTexture(const char *name, const std::string &path) {
+    return loadTexture(path + '/' + std::string(name));
+}
+
+MeshData processMesh(aiMesh *mesh, const aiScene *scene) {
+    MeshData data;
+    data.vertices.reserve(mesh->mNumVertices);
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
+        Vertex vertex;
+        vertex.position = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y,
+                                    mesh->mVertices[i].z);
+        vertex.normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y,
+                                  mesh->mNormals[i].z);
+        if (mesh->mTextureCoords[0]) {
+            vertex.texCoords = glm::vec2(mesh->mTextureCoords[0][i].x,
+                                         mesh->mTextureCoords[0][i].y);
+        } else
+            vertex.texCoords = glm::vec2(0.0f);
+        data.vertices.push_back(vertex);
+    }
+
+    for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
+        aiFace face = mesh->mFaces[i];
+        for (unsigned int j = 0; j < face.mNumIndices; j++) {
+            data.indices.push_back(face.mIndices[j]);
+        }
+    }
+
+    if (mesh->mMaterialIndex >= 0) {
+        aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
+        for (auto [aiType, type] : {std::pair(aiTextureType_DIFFUSE, DIFFUSE),
+                                    std::pair(aiTextureType_SPECULAR,
+                                              SPECULAR)}) {
+            for (unsigned int i = 0; i < material->GetTextureCount(aiType);
+                 i++) {
+                aiString string;
+                material->GetTexture(aiType, i, &string);
+                data.textures.push_back({type, string.C_Str()});
+            }
+        }
+    }
+    return data;
+}
+
+void processNode(aiNode *node, const aiScene *scene, ModelData &model) {
+    for (unsigned int i = 0; i < node->mNumMeshes; i++) {
+        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
+        model.meshes.push_back(processMesh(mesh, scene));
+    }
+    for (unsigned int i = 0; i < node->mNumChildren; i++) {
+        processNode(node->mChildren[i], scene, model);
+    }
+}
+
+// Parse a model file into CPU memory. Touches no GL state, so it is safe to
+// call from worker threads.
+bool importModel(const std::string &path, ModelData &model) {
+    Assimp::Importer importer;
+    const aiScene *scene =
+        importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
+
+    if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE ||
+        !scene->mRootNode) {
+        std::cerr << "ERROR ASSIMP\n"
+                  << importer.GetErrorString() << std::endl;
+        return false;
+    }
+    model.directory = path.substr(0, path.find_last_of('/'));
+    processNode(scene->mRootNode, scene, model);
+    for (size_t i = 0; i < model.meshes.size(); i++) {
+        if (MeshOptimizer::enabled)
+            MeshOptimizer::optimize(model.meshes[i],
+                                    path + " mesh " + std::to_string(i));
+    }
+    if (Mesh::splitLargeMeshes) {
+        std::vector<MeshData> meshes;
+        for (MeshData &mesh : model.meshes) {
+            for (MeshData &part : splitMesh(mesh))
+                meshes.push_back(std::move(part));
+        }
+        model.meshes = std::move(meshes);
+    }
+    for (MeshData &mesh : model.meshes) {
+        mesh.format = VertexFormat::choose(
+            mesh.vertices.data(), mesh.vertices.size(),
+            computeBounds(mesh.vertices.data(), mesh.vertices.size()));
+    }
+    return true;
 }
 
 class Model {
    public:
-    Model(std::string &path) { load(path); }
+    Model() = default;
+    Model(const std::string &path) { load(path); }
+    Model(const Model &) = delete;
+    Model &operator=(const Model &) = delete;
+    ~Model() {
+        for (Mesh &mesh : meshes) mesh.release();
+        for (unsigned int id : textureRefs)
+            TextureCache::instance().release(id);
+    }
     void draw(Shader &shader) {
         for (unsigned int i = 0; i < meshes.size(); i++) {
             meshes[i].draw(shader);
         }
     }
-
-   private:
-    std::vector<Mesh> meshes;
-    std::string path;
-    std::vector<Texture> loadedTextures;
-
-    void load(std::string &path) {
-        Assimp::Importer importer;
-        const aiScene *scene =
-            importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
-
-        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE ||
-            !scene->mRootNode) {
-            std::cerr << "ERROR ASSIMP\n"
-                      << importer.GetErrorString() << std::endl;
-            return;
+    void draw(Shader &shader, InstanceBatch &batch) {
+        for (unsigned int i = 0; i < meshes.size(); i++) {
+            meshes[i].draw(shader, batch);
         }
-        this->path = path.substr(0, path.find_last_of('/'));
-        processNode(scene->mRootNode, scene);
     }
-    void processNode(aiNode *node, const aiScene *scene) {
-        for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-            aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
-        }
-        for (unsigned int i = 0; i < node->mNumChildren; i++) {
-            processNode(node->mChildren[i], scene);
+    // Union of the mesh bounds, in model space.
+    Bounds bounds() const {
+        if (meshes.empty()) return {glm::vec3(0.0f), glm::vec3(0.0f)};
+        Bounds result = meshes[0].bounds;
+        for (const Mesh &mesh : meshes) {
+            result.min = glm::min(result.min, mesh.bounds.min);
+            result.max = glm::max(result.max, mesh.bounds.max);
         }
+        return result;
+    }
+    // Adds every mesh to batch; nothing is drawn until batch.draw().
+    void queue(IndirectBatch &batch,
+               const glm::mat4 &transform = glm::mat4(1.0f)) const {
+        for (const Mesh &mesh : meshes) batch.add(mesh, transform);
+    }
+    void queue(RenderQueue &queue, Shader &shader,
+               const glm::mat4 &transform = glm::mat4(1.0f),
+               RenderPass pass = OPAQUE_PASS) const {
+        for (const Mesh &mesh : meshes)
+            queue.submit(shader, mesh, transform, pass);
+    }
+    // Every mesh goes in with the variant its material needs.
+    void queue(RenderQueue &queue, ShaderVariants &variants,
+               const glm::mat4 &transform = glm::mat4(1.0f),
+               RenderPass pass = OPAQUE_PASS) const {
+        for (const Mesh &mesh : meshes)
+            queue.submit(mesh.shader(variants), mesh, transform, pass);
     }
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene) {
-        std::vector<Vertex> vertices;
-        std::vector<unsigned int> indices;
-        std::vector<Texture> textures;
 
-        for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
-            Vertex vertex;
-            vertex.position =
-                glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y,
-                          mesh->mVertices[i].z);
-            vertex.normal = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y,
-                                      mesh->mNormals[i].z);
-            if (mesh->mTextureCoords[0]) {
-                vertex.texCoords = glm::vec2(mesh->mTextureCoords[0][i].x,
-                                             mesh->mTextureCoords[0][i].y);
-            } else
-                vertex.texCoords = glm::vec2(0.0f);
-            vertices.push_back(vertex);
-        }
+   private:
+    friend class ModelLoader;
+
+    std::vector<Mesh> meshes;
+    std::string path;
+    std::vector<unsigned int> textureRefs;
 
-        for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
-            aiFace face = mesh->mFaces[i];
-            for (unsigned int j = 0; j < face.mNumIndices; j++) {
-                indices.push_back(face.mIndices[j]);
+    void load(const std::string &path) {
+        MeshCache cache;
+        if (MeshCache::enabled && MeshCache::isFresh(path) &&
+            cache.open(MeshCache::pathFor(path))) {
+            this->path = path.substr(0, path.find_last_of('/'));
+            for (size_t i = 0; i < cache.size(); i++) {
+                meshes.push_back(
+                    Mesh(cache.mesh(i), loadTextures(cache.textures(i))));
             }
+            return;
         }
 
-        if (mesh->mMaterialIndex >= 0) {
-            aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
-            std::vector<Texture> diffuse =
-                loadTextures(material, aiTextureType_DIFFUSE, DIFFUSE);
-            textures.insert(textures.end(), diffuse.begin(), diffuse.end());
-            std::vector<Texture> specular =
-                loadTextures(material, aiTextureType_SPECULAR, SPECULAR);
-            textures.insert(textures.end(), specular.begin(), specular.end());
+        ModelData data;
+        if (!importModel(path, data)) return;
+        if (MeshCache::enabled)
+            MeshCache::write(MeshCache::pathFor(path), data);
+        this->path = data.directory;
+        for (MeshData &mesh : data.meshes) {
+            meshes.push_back(Mesh(std::move(mesh.vertices),
+                                  std::move(mesh.indices),
+                                  loadTextures(mesh.textures), mesh.format));
         }
-
-        return Mesh(vertices, indices, textures);
     }
-    std::vector<Texture> loadTextures(aiMaterial *material, aiTextureType type,
-                                      TextureType typeName) {
+    std::vector<Texture> loadTextures(const std::vector<TextureRef> &refs) {
         std::vector<Texture> textures;
-        for (unsigned int i = 0; i < material->GetTextureCount(type); i++) {
-            aiString string;
-            material->GetTexture(type, i, &string);
-            bool skip = false;
-            for (unsigned int j = 0; j < loadedTextures.size(); j++) {
-                if (loadedTextures[j].path == std::string(string.C_Str())) {
-                    textures.push_back(loadedTextures[j]);
-                    skip = true;
-                    break;
-                }
-            }
-            if (skip) continue;
+        for (const TextureRef &ref : refs) {
             Texture texture;
-            texture.id = importTexture(string.C_Str(), path);
-            texture.type = typeName;
-            texture.path = string.C_Str();
+            texture.id = importTexture(ref.path.c_str(), path);
+            texture.type = ref.type;
+            texture.path = ref.path;
             textures.push_back(texture);
-            loadedTextures.push_back(texture);
+            if (texture.id) textureRefs.push_back(texture.id);
         }
         return textures;
     }
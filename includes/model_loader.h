@@ -0,0 +1,192 @@
+#ifndef MODEL_LOADER_H
+#define MODEL_LOADER_H
+
+#include <model.h>
+#include <thread_pool.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Result of ModelLoader::load. The model may only be used once ready()
+// returns true; it is filled in on the GL thread by ModelLoader::update.
+class ModelHandle {
+   public:
+    enum State { LOADING, READY, FAILED };
+
+    State state() const { return current.load(); }
+    bool ready() const { return current.load() == READY; }
+    Model &model() { return result; }
+
+   private:
+    friend class ModelLoader;
+
+    std::atomic<State> current = LOADING;
+    Model result;
+    ModelData data;
+    MeshCache cache;
+    std::vector<std::string> texturePaths;
+    std::unordered_map<std::string, size_t> textureIndex;
+    std::vector<ImageData> images;
+    std::vector<unsigned int> textureIds;
+    std::atomic<size_t> pendingImages = 0;
+};
+
+// Runs Assimp import and image decoding on a thread pool, and leaves only
+// the GL uploads to the render thread, which drains them in small
+// per-frame slices through update().
+class ModelLoader {
+   public:
+    ModelLoader(ThreadPool &pool)
+        : pool(pool), queue(std::make_shared<UploadQueue>()) {}
+
+    std::shared_ptr<ModelHandle> load(const std::string &path) {
+        auto handle = std::make_shared<ModelHandle>();
+        ThreadPool &pool = this->pool;
+        std::shared_ptr<UploadQueue> queue = this->queue;
+        pool.submit([&pool, queue, handle, path] {
+            if (MeshCache::enabled && MeshCache::isFresh(path) &&
+                handle->cache.open(MeshCache::pathFor(path))) {
+                // Geometry is uploaded straight from the mapping later;
+                // only the material bindings are needed here.
+                handle->data.directory = path.substr(0, path.find_last_of('/'));
+                handle->data.meshes.resize(handle->cache.size());
+                for (size_t i = 0; i < handle->cache.size(); i++)
+                    handle->data.meshes[i].textures = handle->cache.textures(i);
+            } else if (importModel(path, handle->data)) {
+                if (MeshCache::enabled)
+                    MeshCache::write(MeshCache::pathFor(path), handle->data);
+            } else {
+                handle->current = ModelHandle::FAILED;
+                return;
+            }
+            for (const MeshData &mesh : handle->data.meshes) {
+                for (const TextureRef &ref : mesh.textures) {
+                    if (handle->textureIndex
+                            .emplace(ref.path, handle->texturePaths.size())
+                            .second)
+                        handle->texturePaths.push_back(ref.path);
+                }
+            }
+            size_t count = handle->texturePaths.size();
+            handle->images.resize(count);
+            handle->textureIds.resize(count);
+            if (count == 0) {
+                queueMeshes(*queue, handle);
+                return;
+            }
+            handle->pendingImages = count;
+            for (size_t i = 0; i < count; i++) {
+                pool.submit([queue, handle, i] {
+                    // Textures already in the shared cache, by path or by
+                    // content, are neither decoded nor uploaded again.
+                    TextureCache &cache = TextureCache::instance();
+                    std::string file =
+                        handle->data.directory + '/' + handle->texturePaths[i];
+                    std::string key = TextureCache::normalize(file);
+                    unsigned int id = cache.acquire(key);
+                    std::uint64_t hash = 0;
+                    if (!id) {
+                        handle->images[i] = decodeImage(file);
+                        if (handle->images[i].valid() &&
+                            TextureCache::hashContents)
+                            hash = hashImage(handle->images[i]);
+                        id = cache.acquire(key, hash);
+                    }
+                    if (id || !handle->images[i].valid()) {
+                        freeImage(handle->images[i]);
+                        handle->textureIds[i] = id;
+                        if (--handle->pendingImages == 0)
+                            queueMeshes(*queue, handle);
+                        return;
+                    }
+                    queue->push([queue, handle, i, key, hash] {
+                        handle->textureIds[i] = TextureCache::instance().insert(
+                            key, uploadTexture(handle->images[i]), hash);
+                        if (--handle->pendingImages == 0)
+                            queueMeshes(*queue, handle);
+                    });
+                });
+            }
+        });
+        return handle;
+    }
+
+    // Perform queued GL uploads on the calling thread until the budget is
+    // spent. At least one upload runs per call so loading always advances.
+    void update(std::chrono::microseconds budget =
+                    std::chrono::milliseconds(2)) {
+        auto start = std::chrono::steady_clock::now();
+        do {
+            std::function<void()> upload;
+            if (!queue->pop(upload)) break;
+            upload();
+        } while (std::chrono::steady_clock::now() - start < budget);
+    }
+
+   private:
+    struct UploadQueue {
+        std::mutex mutex;
+        std::queue<std::function<void()>> uploads;
+
+        void push(std::function<void()> upload) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uploads.push(std::move(upload));
+        }
+        bool pop(std::function<void()> &upload) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (uploads.empty()) return false;
+            upload = std::move(uploads.front());
+            uploads.pop();
+            return true;
+        }
+    };
+
+    ThreadPool &pool;
+    std::shared_ptr<UploadQueue> queue;
+
+    // One upload per mesh, so a large model is spread over several frames.
+    static void queueMeshes(UploadQueue &queue,
+                            std::shared_ptr<ModelHandle> handle) {
+        handle->result.path = handle->data.directory;
+        for (unsigned int id : handle->textureIds)
+            if (id) handle->result.textureRefs.push_back(id);
+        size_t count = handle->data.meshes.size();
+        if (count == 0) {
+            handle->current = ModelHandle::READY;
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            queue.push([handle, i, count] {
+                MeshData &data = handle->data.meshes[i];
+                std::vector<Texture> textures;
+                for (const TextureRef &ref : data.textures) {
+                    size_t index = handle->textureIndex[ref.path];
+                    textures.push_back(
+                        {handle->textureIds[index], ref.type, ref.path});
+                }
+                const MeshCache &cache = handle->cache;
+                if (cache.isOpen())
+                    handle->result.meshes.push_back(
+                        Mesh(cache.mesh(i), std::move(textures)));
+                else
+                    handle->result.meshes.push_back(
+                        Mesh(std::move(data.vertices), std::move(data.indices),
+                             std::move(textures), data.format));
+                if (i + 1 == count) {
+                    handle->data = {};
+                    handle->cache.close();
+                    handle->current = ModelHandle::READY;
+                }
+            });
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef OFFSCREEN_CONTEXT_H
+#define OFFSCREEN_CONTEXT_H
+
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <iostream>
+
+// A core profile context with no window and no surface, for checks that
+// run headless, e.g. on Mesa's llvmpipe without a display. Everything is
+// drawn into framebuffer objects.
+class OffscreenContext {
+   public:
+    OffscreenContext(int major = 4, int minor = 3) {
+        auto getPlatformDisplay =
+            reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+                eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        if (getPlatformDisplay)
+            display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                         EGL_DEFAULT_DISPLAY, nullptr);
+        if (display == EGL_NO_DISPLAY)
+            display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (!eglInitialize(display, nullptr, nullptr) ||
+            !eglBindAPI(EGL_OPENGL_API)) {
+            std::cerr << "ERROR EGL INITIALIZATION FAILED" << std::endl;
+            return;
+        }
+
+        const EGLint attributes[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                     major,
+                                     EGL_CONTEXT_MINOR_VERSION,
+                                     minor,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                     EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                     EGL_NONE};
+        context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+                                   attributes);
+        if (context == EGL_NO_CONTEXT ||
+            !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                            context)) {
+            std::cerr << "ERROR EGL CONTEXT CREATION FAILED" << std::endl;
+            return;
+        }
+
+        // GLEW built for GLX loads every GL entry point before it finds
+        // there is no GLX display.
+        GLenum error = glewInit();
+        if (error != GLEW_OK && error != GLEW_ERROR_NO_GLX_DISPLAY) {
+            std::cerr << "ERROR GLEW INITIALIZATION FAILED" << std::endl;
+            return;
+        }
+        current = true;
+    }
+    ~OffscreenContext() {
+        if (display == EGL_NO_DISPLAY) return;
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       EGL_NO_CONTEXT);
+        if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+        eglTerminate(display);
+    }
+    OffscreenContext(const OffscreenContext &) = delete;
+    OffscreenContext &operator=(const OffscreenContext &) = delete;
+
+    // Whether the context was created and GL is ready to use.
+    bool ready() const { return current; }
+
+   private:
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+    bool current = false;
+};
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <frustum.h>
+#include <geometry_arena.h>
+#include <gl_state.h>
+#include <mesh.h>
+#include <shader.h>
+#include <software_occlusion.h>
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+enum RenderPass { OPAQUE_PASS, TRANSPARENT_PASS };
+
+struct SortItem {
+    std::uint64_t key;
+    std::uint32_t index;
+};
+
+// LSD radix sort on 8-bit digits. Digits every key shares are skipped, so
+// a frame where most fields are equal costs only a few passes.
+inline void radixSort(std::vector<SortItem> &items,
+                      std::vector<SortItem> &scratch) {
+    scratch.resize(items.size());
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {};
+        for (const SortItem &item : items) counts[item.key >> shift & 0xff]++;
+        if (counts[items.empty() ? 0 : items[0].key >> shift & 0xff] ==
+            items.size())
+            continue;
+        size_t offset = 0;
+        for (size_t &count : counts) {
+            size_t next = offset + count;
+            count = offset;
+            offset = next;
+        }
+        for (const SortItem &item : items)
+            scratch[counts[item.key >> shift & 0xff]++] = item;
+        items.swap(scratch);
+    }
+}
+
+// State changes made by the last RenderQueue::flush().
+struct RenderStats {
+    size_t draws = 0;
+    size_t programs = 0;
+    size_t vertexArrays = 0;
+    size_t textureSets = 0;
+};
+
+// Mesh draws for a frame, submitted in any order and drawn sorted by a
+// packed key so programs, VAOs and textures change only when the key does.
+// From the top bit down the key holds the pass, shader, vertex array,
+// texture set and view depth. Opaque draws go front to back, transparent
+// ones back to front.
+class RenderQueue {
+   public:
+    static constexpr int PASS_BITS = 2;
+    static constexpr int SHADER_BITS = 10;
+    static constexpr int VERTEX_ARRAY_BITS = 8;
+    static constexpr int MATERIAL_BITS = 20;
+    static constexpr int DEPTH_BITS = 24;
+
+    static std::uint64_t makeKey(RenderPass pass, std::uint32_t shader,
+                                 std::uint32_t vertexArray,
+                                 std::uint32_t material, std::uint32_t depth) {
+        std::uint64_t key = pass;
+        key = key << SHADER_BITS | (shader & mask(SHADER_BITS));
+        key = key << VERTEX_ARRAY_BITS |
+              (vertexArray & mask(VERTEX_ARRAY_BITS));
+        key = key << MATERIAL_BITS | (material & mask(MATERIAL_BITS));
+        return key << DEPTH_BITS | (depth & mask(DEPTH_BITS));
+    }
+
+    // Distances are non-negative, so their float bits already sort as
+    // integers; keep the top DEPTH_BITS of them.
+    static std::uint32_t quantizeDepth(float distance) {
+        std::uint32_t bits;
+        distance = glm::max(distance, 0.0f);
+        std::memcpy(&bits, &distance, sizeof(bits));
+        return bits >> (31 - DEPTH_BITS);
+    }
+
+    // Clears the queue; depths are measured from viewPosition.
+    void begin(const glm::vec3 &viewPosition) {
+        this->viewPosition = viewPosition;
+        items.clear();
+        draws.clear();
+        culling.clear();
+        shaderIndex.clear();
+        vertexArrayIndex.clear();
+        materials.clear();
+        lastCulled = 0;
+    }
+
+    void submit(Shader &shader, const Mesh &mesh, const glm::mat4 &model,
+                RenderPass pass = OPAQUE_PASS) {
+        GLuint vao = GeometryArena::instance().vao(mesh.format);
+        glm::vec3 center = (mesh.bounds.min + mesh.bounds.max) * 0.5f;
+        center = glm::vec3(model * glm::vec4(center, 1.0f));
+        std::uint32_t depth =
+            quantizeDepth(glm::distance(center, viewPosition));
+        if (pass == TRANSPARENT_PASS) depth = ~depth;
+
+        auto shaderIt = shaderIndex.try_emplace(&shader, shaderIndex.size());
+        auto vaoIt = vertexArrayIndex.try_emplace(vao, vertexArrayIndex.size());
+
+        std::uint32_t material = materials.add(mesh.textures);
+
+        items.push_back(
+            {makeKey(pass, shaderIt.first->second, vaoIt.first->second,
+                     material, depth),
+             std::uint32_t(draws.size())});
+        Bounds bounds = transformBounds(mesh.bounds, model);
+        draws.push_back({&mesh, &shader, vao, material, model, bounds});
+        culling.add(bounds, transformSphere(mesh.sphere, model));
+    }
+
+    // Drop the draws outside frustum. Call before flush().
+    void cull(const Frustum &frustum) {
+        culling.cull(frustum, visible);
+        keep(visible);
+    }
+    // Drop the draws hidden behind the occluders rendered into occlusion.
+    // Call before flush().
+    void cull(SoftwareOcclusion &occlusion) {
+        worldBounds.clear();
+        for (const Draw &draw : draws) worldBounds.push_back(draw.bounds);
+        occlusion.cull(worldBounds, visible);
+        keep(visible);
+    }
+    // Draws dropped by cull() since begin().
+    size_t culled() const { return lastCulled; }
+
+    void flush() {
+        lastStats = {};
+        radixSort(items, scratch);
+
+        Shader *shader = nullptr;
+        GLuint vao = 0;
+        std::uint32_t currentMaterial = ~0u;
+        for (const SortItem &item : items) {
+            const Draw &draw = draws[item.index];
+            if (draw.shader != shader) {
+                shader = draw.shader;
+                shader->use();
+                lastStats.programs++;
+                // Sampler uniforms belong to the program.
+                currentMaterial = ~0u;
+            }
+            if (draw.vao != vao) {
+                vao = draw.vao;
+                GLState::instance().bindVertexArray(vao);
+                lastStats.vertexArrays++;
+            }
+            if (draw.material != currentMaterial) {
+                currentMaterial = draw.material;
+                bindTextures(*shader, materials[draw.material]);
+                lastStats.textureSets++;
+            }
+            const Mesh &mesh = *draw.mesh;
+            const ObjectUniforms &object = shader->objectUniforms();
+            shader->set(object.model, draw.model);
+            shader->set(object.normalModel,
+                        glm::mat3(glm::transpose(glm::inverse(draw.model))));
+            mesh.setDequantization(*shader);
+            glDrawElementsBaseVertex(GL_TRIANGLES, mesh.geometry.indexCount,
+                                     mesh.geometry.indexType,
+                                     mesh.geometry.indexOffset(),
+                                     mesh.geometry.baseVertex);
+            lastStats.draws++;
+        }
+    }
+
+    size_t size() const { return items.size(); }
+    const RenderStats &stats() const { return lastStats; }
+
+   private:
+    struct Draw {
+        const Mesh *mesh;
+        Shader *shader;
+        GLuint vao;
+        std::uint32_t material;
+        glm::mat4 model;
+        Bounds bounds;
+    };
+
+    glm::vec3 viewPosition = glm::vec3(0.0f);
+    std::vector<SortItem> items, scratch;
+    std::vector<Draw> draws;
+    CullingSet culling;
+    std::vector<std::uint32_t> visible;
+    std::vector<Bounds> worldBounds;
+    size_t lastCulled = 0;
+    std::unordered_map<const Shader *, std::uint32_t> shaderIndex;
+    std::unordered_map<GLuint, std::uint32_t> vertexArrayIndex;
+    MaterialTable materials;
+    RenderStats lastStats;
+
+    static constexpr std::uint64_t mask(int bits) {
+        return (std::uint64_t(1) << bits) - 1;
+    }
+
+    void keep(const std::vector<std::uint32_t> &indices) {
+        lastCulled += draws.size() - indices.size();
+        for (size_t i = 0; i < indices.size(); i++) {
+            items[i] = {items[indices[i]].key, std::uint32_t(i)};
+            draws[i] = draws[indices[i]];
+        }
+        items.resize(indices.size());
+        draws.resize(indices.size());
+        culling.keep(indices);
+    }
+};
+
+#endif
@@ -3,18 +3,266 @@
 
 #include <GL/glew.h>
 #include <GLM/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <string>
+#include <filesystem>
 #include <fstream>
+#include <initializer_list>
+#include <map>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <type_traits>
+#include <unordered_map>
+
+#include <gl_state.h>
+#include <uniform_buffer.h>
+
+template <typename T>
+struct Uniform {
+    GLint location = -1;
+};
+
+struct UniformInfo {
+    GLint location;
+    GLenum type;
+    GLint size;
+};
+
+// Per-object uniforms of the mesh vertex shaders, resolved when a program
+// is linked so draws never look them up by name.
+struct ObjectUniforms {
+    Uniform<glm::mat4> model;
+    Uniform<glm::mat3> normalModel;
+    Uniform<glm::vec3> positionScale;
+    Uniform<glm::vec3> positionOffset;
+    Uniform<int> octahedralNormals;
+};
+
+// The numbered material samplers, material.diffuse, material.diffuse1, ...
+// and likewise for specular, as many as the program uses.
+struct MaterialUniforms {
+    std::vector<Uniform<int>> diffuse;
+    std::vector<Uniform<int>> specular;
+};
+
+// Preprocessor symbols and their values, defined at the top of every stage.
+using ShaderDefines = std::map<std::string, int>;
 
 class Shader {
    public:
+    // Linked programs are stored here as driver binaries and reused on the
+    // next launch. An empty path disables the cache.
+    static inline std::filesystem::path binaryCacheDirectory =
+        "./shaders/cache";
+
     unsigned int id;
-    Shader(const char *vertexPath, const char *fragmentPath) {
-        std::string vertexCode, fragmentCode;
+    // fragmentPrelude, when given, names GLSL shared between fragment
+    // shaders, e.g. lightingPrelude(); it goes in after the defines.
+    Shader(const char *vertexPath, const char *fragmentPath,
+           const ShaderDefines &defines = {},
+           const char *fragmentPrelude = nullptr) {
+        std::string vertexCode, fragmentCode, preludeCode;
         readFile(vertexPath, vertexCode);
         readFile(fragmentPath, fragmentCode);
+        if (fragmentPrelude) readFile(fragmentPrelude, preludeCode);
+        vertexCode = inject(vertexCode, defines);
+        fragmentCode = inject(fragmentCode, defines, preludeCode);
+
+        id = glCreateProgram();
+        std::filesystem::path binaryPath =
+            binaryCachePath({vertexCode, fragmentCode});
+        if (!loadBinary(binaryPath)) {
+            compile(vertexCode, fragmentCode);
+            saveBinary(binaryPath);
+        }
+
+        reflect();
+    }
+    explicit Shader(const char *computePath,
+                    const ShaderDefines &defines = {}) {
+        std::string computeCode;
+        readFile(computePath, computeCode);
+        computeCode = inject(computeCode, defines);
+
+        id = glCreateProgram();
+        std::filesystem::path binaryPath = binaryCachePath({computeCode});
+        if (!loadBinary(binaryPath)) {
+            compile(computeCode);
+            saveBinary(binaryPath);
+        }
+
+        reflect();
+    }
+    void use() const { GLState::instance().useProgram(id); }
+
+    // Resolve a uniform once, outside the render loop. Unknown or inactive
+    // names yield location -1, which glProgramUniform* silently ignores.
+    template <typename T>
+    Uniform<T> uniform(const std::string &name) const {
+        auto it = uniforms.find(name);
+        if (it == uniforms.end()) return {};
+        if (!matches<T>(it->second.type))
+            std::cerr << "ERROR UNIFORM TYPE MISMATCH: " << name << std::endl;
+        return {it->second.location};
+    }
+
+    void set(Uniform<int> uniform, int value) const {
+        glProgramUniform1i(id, uniform.location, value);
+    }
+    void set(Uniform<float> uniform, float value) const {
+        glProgramUniform1f(id, uniform.location, value);
+    }
+    void set(Uniform<glm::vec2> uniform, const glm::vec2 &value) const {
+        glProgramUniform2fv(id, uniform.location, 1, &value[0]);
+    }
+    void set(Uniform<glm::vec3> uniform, const glm::vec3 &value) const {
+        glProgramUniform3fv(id, uniform.location, 1, &value[0]);
+    }
+    void set(Uniform<glm::vec4> uniform, const glm::vec4 &value) const {
+        glProgramUniform4fv(id, uniform.location, 1, &value[0]);
+    }
+    void set(Uniform<glm::mat3> uniform, const glm::mat3 &value) const {
+        glProgramUniformMatrix3fv(id, uniform.location, 1, GL_FALSE,
+                                  &value[0][0]);
+    }
+    void set(Uniform<glm::mat4> uniform, const glm::mat4 &value) const {
+        glProgramUniformMatrix4fv(id, uniform.location, 1, GL_FALSE,
+                                  &value[0][0]);
+    }
+
+    const ObjectUniforms &objectUniforms() const { return object; }
+    const MaterialUniforms &materialUniforms() const { return material; }
+
+    void set(const std::string &name, int value) const {
+        set(uniform<int>(name), value);
+    }
+    void set(const std::string &name, float value) const {
+        set(uniform<float>(name), value);
+    }
+    void set(const std::string &name, glm::vec2 value) const {
+        set(uniform<glm::vec2>(name), value);
+    }
+    void set(const std::string &name, glm::vec3 value) const {
+        set(uniform<glm::vec3>(name), value);
+    }
+    void set(const std::string &name, glm::vec4 value) const {
+        set(uniform<glm::vec4>(name), value);
+    }
+    void set(const std::string &name, glm::mat3 value) const {
+        set(uniform<glm::mat3>(name), value);
+    }
+    void set(const std::string &name, glm::mat4 value) const {
+        set(uniform<glm::mat4>(name), value);
+    }
+
+   private:
+    std::unordered_map<std::string, UniformInfo> uniforms;
+    ObjectUniforms object;
+    MaterialUniforms material;
+
+    void reflect() {
+        GLint count, maxLength;
+        glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::string name(maxLength, '\0');
+        for (GLint i = 0; i < count; i++) {
+            GLsizei length;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(id, i, maxLength, &length, &size, &type,
+                               name.data());
+            std::string key = name.substr(0, length);
+            GLint location = glGetUniformLocation(id, key.c_str());
+            if (location < 0) continue;  // Member of a uniform block
+            uniforms[key] = {location, type, size};
+            GLint unit = isSampler(type) ? textureUnit(key) : -1;
+            if (unit >= 0) glProgramUniform1i(id, location, unit);
+
+            // Arrays of basic types are reported once as "name[0]"; expose
+            // the bare name and every element as well.
+            if (key.ends_with("[0]")) {
+                std::string base = key.substr(0, key.size() - 3);
+                uniforms[base] = {location, type, size};
+                for (GLint j = 1; j < size; j++) {
+                    std::string element = base + '[' + std::to_string(j) + ']';
+                    uniforms[element] = {
+                        glGetUniformLocation(id, element.c_str()), type, 1};
+                }
+            }
+        }
+
+        GLint blocks;
+        glGetProgramiv(id, GL_ACTIVE_UNIFORM_BLOCKS, &blocks);
+        glGetProgramiv(id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+        name.assign(maxLength, '\0');
+        for (GLint i = 0; i < blocks; i++) {
+            GLsizei length;
+            glGetActiveUniformBlockName(id, i, maxLength, &length, name.data());
+            GLint binding = uniformBinding(name.substr(0, length));
+            if (binding < 0) {
+                std::cerr << "ERROR UNKNOWN UNIFORM BLOCK: "
+                          << name.substr(0, length) << std::endl;
+                continue;
+            }
+            glUniformBlockBinding(id, i, binding);
+        }
+
+        object.model = uniform<glm::mat4>("model");
+        object.normalModel = uniform<glm::mat3>("normalModel");
+        object.positionScale = uniform<glm::vec3>("positionScale");
+        object.positionOffset = uniform<glm::vec3>("positionOffset");
+        object.octahedralNormals = uniform<int>("octahedralNormals");
+        material.diffuse = numbered("material.diffuse");
+        material.specular = numbered("material.specular");
+    }
+    // base, base1, base2, ... up to the first one the program lacks.
+    std::vector<Uniform<int>> numbered(const std::string &base) const {
+        std::vector<Uniform<int>> handles;
+        std::string name = base;
+        while (uniforms.count(name)) {
+            handles.push_back(uniform<int>(name));
+            name = base + std::to_string(handles.size());
+        }
+        return handles;
+    }
+    template <typename T>
+    static bool matches(GLenum type) {
+        if constexpr (std::is_same_v<T, int>)
+            return type == GL_INT || type == GL_BOOL || isSampler(type);
+        if constexpr (std::is_same_v<T, float>)
+            return type == GL_FLOAT;
+        if constexpr (std::is_same_v<T, glm::vec2>)
+            return type == GL_FLOAT_VEC2;
+        if constexpr (std::is_same_v<T, glm::vec3>)
+            return type == GL_FLOAT_VEC3;
+        if constexpr (std::is_same_v<T, glm::vec4>)
+            return type == GL_FLOAT_VEC4;
+        if constexpr (std::is_same_v<T, glm::mat3>)
+            return type == GL_FLOAT_MAT3;
+        if constexpr (std::is_same_v<T, glm::mat4>)
+            return type == GL_FLOAT_MAT4;
+        return false;
+    }
+    static bool isSampler(GLenum type) {
+        switch (type) {
+            case GL_SAMPLER_2D:
+            case GL_SAMPLER_3D:
+            case GL_SAMPLER_CUBE:
+            case GL_SAMPLER_2D_SHADOW:
+            case GL_SAMPLER_2D_ARRAY:
+            case GL_SAMPLER_2D_ARRAY_SHADOW:
+                return true;
+            default:
+                return false;
+        }
+    }
+    enum compilationType { PROGRAM, VERTEX, FRAGMENT, COMPUTE };
+    void compile(const std::string &vertexCode,
+                 const std::string &fragmentCode) {
         GLuint vertexShader, fragmentShader;
         const char *vertexChar = vertexCode.c_str();
         const char *fragmentChar = fragmentCode.c_str();
@@ -27,45 +275,129 @@ class Shader {
         glCompileShader(fragmentShader);
         check(fragmentShader, compilationType::FRAGMENT);
 
-        id = glCreateProgram();
         glAttachShader(id, vertexShader);
         glAttachShader(id, fragmentShader);
+        glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(id);
         check(id, compilationType::PROGRAM);
 
+        glDetachShader(id, vertexShader);
+        glDetachShader(id, fragmentShader);
         glDeleteShader(vertexShader);
         glDeleteShader(fragmentShader);
     }
-    void use() const { glUseProgram(id); }
-    void set(const std::string &name, int value) const {
-        glProgramUniform1i(id, glGetUniformLocation(id, name.c_str()), value);
-    }
-    void set(const std::string &name, float value) const {
-        glProgramUniform1f(id, glGetUniformLocation(id, name.c_str()), value);
-    }
-    void set(const std::string &name, glm::vec2 value) const {
-        glProgramUniform2fv(id, glGetUniformLocation(id, name.c_str()), 1,
-                            &value[0]);
+    void compile(const std::string &computeCode) {
+        const char *computeChar = computeCode.c_str();
+        GLuint computeShader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(computeShader, 1, &computeChar, nullptr);
+        glCompileShader(computeShader);
+        check(computeShader, compilationType::COMPUTE);
+
+        glAttachShader(id, computeShader);
+        glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(id);
+        check(id, compilationType::PROGRAM);
+
+        glDetachShader(id, computeShader);
+        glDeleteShader(computeShader);
     }
-    void set(const std::string &name, glm::vec3 value) const {
-        glProgramUniform3fv(id, glGetUniformLocation(id, name.c_str()), 1,
-                            &value[0]);
+    std::filesystem::path binaryCachePath(
+        std::initializer_list<std::string> sources) const {
+        if (binaryCacheDirectory.empty()) return {};
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        if (formats == 0) return {};
+
+        // FNV-1a over every stage plus the driver identity, so a driver
+        // update or a shader edit never picks up a stale binary.
+        std::uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const char *data, size_t size) {
+            for (size_t i = 0; i < size; i++) {
+                hash ^= static_cast<unsigned char>(data[i]);
+                hash *= 1099511628211ull;
+            }
+            hash ^= 0xff;
+            hash *= 1099511628211ull;
+        };
+        for (const std::string &source : sources)
+            mix(source.data(), source.size());
+        for (GLenum name : {GL_RENDERER, GL_VERSION}) {
+            const char *string =
+                reinterpret_cast<const char *>(glGetString(name));
+            if (string) mix(string, std::strlen(string));
+        }
+
+        char file[17];
+        std::snprintf(file, sizeof(file), "%016llx",
+                      static_cast<unsigned long long>(hash));
+        return binaryCacheDirectory / (std::string(file) + ".bin");
     }
-    void set(const std::string &name, glm::vec4 value) const {
-        glProgramUniform4fv(id, glGetUniformLocation(id, name.c_str()), 1,
-                            &value[0]);
+    bool loadBinary(const std::filesystem::path &path) {
+        if (path.empty()) return false;
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        GLenum format;
+        std::vector<char> binary;
+        file.read(reinterpret_cast<char *>(&format), sizeof(format));
+        if (!file.good()) return false;
+        binary.assign(std::istreambuf_iterator<char>(file),
+                      std::istreambuf_iterator<char>());
+        if (binary.empty()) return false;
+
+        glProgramBinary(id, format, binary.data(), binary.size());
+        GLint result;
+        glGetProgramiv(id, GL_LINK_STATUS, &result);
+        if (result == GL_TRUE) return true;
+
+        // The driver rejected the blob; start over with a clean program.
+        glDeleteProgram(id);
+        id = glCreateProgram();
+        return false;
     }
-    void set(const std::string &name, glm::mat3 value) const {
-        glProgramUniformMatrix3fv(id, glGetUniformLocation(id, name.c_str()), 1,
-                                  GL_FALSE, &value[0][0]);
+    void saveBinary(const std::filesystem::path &path) const {
+        if (path.empty()) return;
+        GLint result, length;
+        glGetProgramiv(id, GL_LINK_STATUS, &result);
+        glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (result == GL_FALSE || length == 0) return;
+
+        GLenum format;
+        std::vector<char> binary(length);
+        glGetProgramBinary(id, length, nullptr, &format, binary.data());
+
+        std::error_code error;
+        std::filesystem::create_directories(path.parent_path(), error);
+        std::ofstream file(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "ERROR WRITING SHADER CACHE: " << path << std::endl;
+            return;
+        }
+        file.write(reinterpret_cast<const char *>(&format), sizeof(format));
+        file.write(binary.data(), binary.size());
     }
-    void set(const std::string &name, glm::mat4 value) const {
-        glProgramUniformMatrix4fv(id, glGetUniformLocation(id, name.c_str()), 1,
-                                  GL_FALSE, &value[0][0]);
+    // Defines and then the prelude go right after the #version line, which
+    // must come first. The #line directives keep compiler messages on the
+    // lines of each file: source string 1 is the prelude, 0 the file.
+    static std::string inject(const std::string &code,
+                              const ShaderDefines &defines,
+                              const std::string &prelude = {}) {
+        if (defines.empty() && prelude.empty()) return code;
+        size_t start = code.find("#version");
+        start = start == std::string::npos ? 0 : code.find('\n', start);
+        start = start == std::string::npos ? code.size() : start + 1;
+        std::string header;
+        for (const auto &[name, value] : defines)
+            header += "#define " + name + ' ' + std::to_string(value) + '\n';
+        if (!prelude.empty()) {
+            header += "#line 1 1\n" + prelude;
+            if (prelude.back() != '\n') header += '\n';
+        }
+        int line = std::count(code.begin(), code.begin() + start, '\n') + 1;
+        header += "#line " + std::to_string(line) + " 0\n";
+        std::string result = code.substr(0, start);
+        if (!result.empty() && result.back() != '\n') result += '\n';
+        return result + header + code.substr(start);
     }
-
-   private:
-    enum compilationType { PROGRAM, VERTEX, FRAGMENT };
     void readFile(const char *path, std::string &out) {
         std::ifstream file;
         file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -87,14 +419,17 @@ class Shader {
         else
             glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
         if (result == GL_FALSE) {
-            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
-            message.resize(length);
-            if (type == compilationType::PROGRAM)
+            if (type == compilationType::PROGRAM) {
+                glGetProgramiv(shader, GL_INFO_LOG_LENGTH, &length);
+                message.resize(length);
                 glGetProgramInfoLog(shader, length, nullptr, message.data());
-            else
+            } else {
+                glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+                message.resize(length);
                 glGetShaderInfoLog(shader, length, nullptr, message.data());
+                glDeleteShader(shader);
+            }
             std::cerr << message << std::endl;
-            glDeleteShader(shader);
         }
     }
 };
@@ -0,0 +1,115 @@
+#ifndef SHADER_VARIANTS_H
+#define SHADER_VARIANTS_H
+
+#include <lights.h>
+#include <shader.h>
+
+#include <cctype>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+
+// Array sizes the lighting shaders share with includes/lights.h.
+inline ShaderDefines lightingDefines() {
+    return {{"MAX_CLUSTER_LIGHTS", MAX_CLUSTER_LIGHTS},
+            {"MAX_CASCADES", MAX_CASCADES}};
+}
+// Light and shadow declarations and lookups the lighting fragment shaders
+// share, to pass as their fragment prelude.
+inline const char *lightingPrelude() { return "./shaders/lighting.glsl"; }
+
+// Programs compiled from one pair of sources with different defines, so a
+// draw runs a variant with the features it does not use compiled out rather
+// than branched over. Shaders test a feature with #if NAME and default it
+// to on. Each variant is built once, when first asked for, and set up by
+// setup() before it is handed out.
+class ShaderVariants {
+   public:
+    // Set a define every variant whose sources use it gets, for switches
+    // that hold for the whole frame. Variants built under earlier values
+    // stay cached.
+    static void setCommon(const std::string &name, int value) {
+        auto [it, inserted] = common.try_emplace(name, value);
+        if (!inserted && it->second == value) return;
+        it->second = value;
+        generation++;
+    }
+    // Moves on whenever a common define changes or a set is created, so a
+    // variant resolved under an earlier revision must be asked for again.
+    static unsigned revision() { return generation; }
+
+    ShaderVariants(const char *vertexPath, const char *fragmentPath,
+                   ShaderDefines defines = {},
+                   std::function<void(Shader &)> setup = {},
+                   const char *fragmentPrelude = nullptr)
+        : vertexPath(vertexPath),
+          fragmentPath(fragmentPath),
+          preludePath(fragmentPrelude ? fragmentPrelude : ""),
+          sources(read(vertexPath) + read(fragmentPath) +
+                  (fragmentPrelude ? read(fragmentPrelude) : "")),
+          defines(std::move(defines)),
+          setup(std::move(setup)) {
+        generation++;
+    }
+    ShaderVariants(const ShaderVariants &) = delete;
+    ShaderVariants &operator=(const ShaderVariants &) = delete;
+
+    // features take precedence over common, which takes precedence over
+    // the defines given at construction.
+    Shader &get(const ShaderDefines &features = {}) {
+        ShaderDefines key = defines;
+        for (const auto &[name, value] : common)
+            if (mentions(name)) key[name] = value;
+        for (const auto &[name, value] : features) key[name] = value;
+        auto it = variants.find(key);
+        if (it == variants.end()) {
+            it = variants
+                     .emplace(key, std::make_unique<Shader>(
+                                       vertexPath.c_str(),
+                                       fragmentPath.c_str(), key,
+                                       preludePath.empty()
+                                           ? nullptr
+                                           : preludePath.c_str()))
+                     .first;
+            if (setup) setup(*it->second);
+        }
+        return *it->second;
+    }
+
+    size_t size() const { return variants.size(); }
+
+   private:
+    static inline ShaderDefines common;
+    static inline unsigned generation = 0;
+
+    std::string vertexPath, fragmentPath, preludePath, sources;
+    ShaderDefines defines;
+    std::function<void(Shader &)> setup;
+    std::map<ShaderDefines, std::unique_ptr<Shader>> variants;
+
+    static std::string read(const char *path) {
+        std::ifstream file(path);
+        return {std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>()};
+    }
+    // Whether name appears in the sources as a whole identifier; common
+    // defines the sources never test would only compile duplicates.
+    bool mentions(const std::string &name) const {
+        auto identifier = [](char c) {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        };
+        for (size_t at = sources.find(name); at != std::string::npos;
+             at = sources.find(name, at + 1)) {
+            size_t end = at + name.size();
+            if ((at == 0 || !identifier(sources[at - 1])) &&
+                (end == sources.size() || !identifier(sources[end])))
+                return true;
+        }
+        return false;
+    }
+};
+
+#endif
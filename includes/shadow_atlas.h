@@ -0,0 +1,394 @@
+#ifndef SHADOW_ATLAS_H
+#define SHADOW_ATLAS_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <camera.h>
+#include <frustum.h>
+#include <gl_state.h>
+#include <light_clusters.h>
+#include <lights.h>
+#include <uniform_buffer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+// Mirrors the std430 ShadowTile struct in shaders/lighting.glsl.
+struct ShadowTile {
+    // World to atlas coordinates and depth, before the perspective divide.
+    glm::mat4 matrix;
+    // Atlas coordinates the tile's filter taps are clamped to.
+    glm::vec4 rect;
+    // World size of a texel per unit of depth.
+    float texelScale;
+    float padding[3];
+};
+
+static_assert(sizeof(ShadowTile) == 96);
+
+// Shadows of point and spot lights, drawn into tiles of one depth texture.
+// Lights whose range is in view get a tile per cube face, or one for a spot
+// light, sized by how much of the screen their range covers; when the
+// tiles do not fit, the least important lights shrink first. A tile keeps
+// its contents until its light moves, its place in the atlas changes, or
+// invalidate() reports a caster moving through its volume. Per frame:
+//
+//     atlas.update(view, projection, height, pointLights, casters, spot);
+//     atlas.invalidate(bounds) for the old and new bounds of moved casters
+//     for each tile that is due():
+//         draw the casters inside casterFrustum(tile) in render()
+//     atlas.apply();
+class ShadowAtlas {
+   public:
+    // Tiles are square, with power of two sides between these.
+    static inline int minTileSize = 128;
+    static inline int maxTileSize = 1024;
+    // Tile texels per pixel of the radius a light's range covers on screen.
+    static inline float detail = 1.0f;
+    // Shadows end this far from their light.
+    static inline float maxDistance = 100.0f;
+    static inline float zNear = 0.05f;
+    // Slope scaled and constant depth bias of the shadow casters.
+    static inline float slopeBias = 2.0f;
+    static inline float constantBias = 4.0f;
+
+    ShadowAtlas(int resolution = 4096) {
+        glGenFramebuffers(1, &framebuffer);
+        glGenBuffers(1, &tileBuffer);
+        configure(resolution);
+    }
+    ~ShadowAtlas() {
+        GLState &state = GLState::instance();
+        state.deleteFramebuffer(framebuffer);
+        state.deleteTexture(texture);
+        state.deleteBuffer(tileBuffer);
+    }
+    ShadowAtlas(const ShadowAtlas &) = delete;
+    ShadowAtlas &operator=(const ShadowAtlas &) = delete;
+
+    // Use an atlas of resolution x resolution texels, rounded down to a
+    // power of two. Every tile falls due again.
+    void configure(int resolution) {
+        this->resolution = minTileSize;
+        while (this->resolution * 2 <= resolution) this->resolution *= 2;
+        cache.clear();
+
+        GLState &state = GLState::instance();
+        if (texture) state.deleteTexture(texture);
+        glGenTextures(1, &texture);
+        state.bindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F,
+                       this->resolution, this->resolution);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE,
+                        GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+        GLint previous;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        state.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_2D, texture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+            GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR SHADOW ATLAS INCOMPLETE" << std::endl;
+        state.bindFramebuffer(GL_FRAMEBUFFER, previous);
+    }
+
+    // Hand out this frame's tiles to the shadow casting lights, the first
+    // casters point lights and spotLight, and set their shadow fields.
+    // height is that of the viewport in pixels.
+    void update(const glm::mat4 &view, const glm::mat4 &projection,
+                int height, std::vector<PointLight> &pointLights,
+                size_t casters, SpotLight &spotLight) {
+        casters = std::min(casters, pointLights.size());
+        glm::vec3 eye(glm::inverse(view)[3]);
+        Frustum frustum = Frustum::fromMatrix(projection * view);
+        float pixelScale = projection[1][1] * height * 0.5f * detail;
+
+        requests.clear();
+        auto claim = [&](int light, const glm::vec3 &position, float range) {
+            range = std::min(range, maxDistance);
+            if (range <= zNear || !frustum.intersects(Sphere{position, range}))
+                return;
+            float distance = glm::length(position - eye);
+            float pixels = range / std::max(distance, range) * pixelScale;
+            int size = tileSize(pixels);
+            // Hold on to the last size near the rounding boundaries, so a
+            // light at rest in front of a slowly moving camera keeps it.
+            int last =
+                size_t(light) < lastSizes.size() ? lastSizes[light] : 0;
+            if (last && pixels > last * 0.6f && pixels < last * 1.7f)
+                size = last;
+            requests.push_back({light, size, pixels, distance});
+        };
+        claim(SPOT_LIGHT, spotLight.position,
+              lightRange(spotLight, LightClusters::cutoff));
+        for (size_t i = 0; i < casters; i++)
+            claim(int(i) + 1, pointLights[i].position,
+                  lightRange(pointLights[i], LightClusters::cutoff));
+
+        // Shrink the least important lights until everything fits, and
+        // drop lights when even the smallest tiles do not.
+        std::sort(requests.begin(), requests.end(),
+                  [](const Request &a, const Request &b) {
+                      if (a.pixels != b.pixels) return a.pixels > b.pixels;
+                      return a.distance < b.distance;
+                  });
+        size_t area = 0, capacity = size_t(resolution) * resolution;
+        for (const Request &request : requests)
+            area += request.area();
+        size_t shrinking = requests.size();
+        while (area > capacity && !requests.empty()) {
+            while (shrinking > 0 &&
+                   requests[shrinking - 1].size <= minTileSize)
+                shrinking--;
+            if (shrinking == 0) {
+                area -= requests.back().area();
+                requests.pop_back();
+                continue;
+            }
+            Request &request = requests[shrinking - 1];
+            area -= request.area();
+            request.size /= 2;
+            area += request.area();
+        }
+
+        // Largest first fills the atlas along a Z-order curve without gaps.
+        // Ties go by light, so lights keep their places while sizes hold.
+        std::sort(requests.begin(), requests.end(),
+                  [](const Request &a, const Request &b) {
+                      if (a.size != b.size) return a.size > b.size;
+                      return a.light < b.light;
+                  });
+        tiles.clear();
+        lastSizes.assign(casters + 1, 0);
+        spotLight.shadow = -1;
+        for (PointLight &light : pointLights) light.shadow = -1;
+        size_t cursor = 0;
+        for (const Request &request : requests) {
+            int first = tiles.size();
+            bool spot = request.light == SPOT_LIGHT;
+            for (int face = 0; face < (spot ? 1 : 6); face++) {
+                Tile tile;
+                tile.key = request.light * 6 + face;
+                tile.offset = cell(cursor) * minTileSize;
+                tile.size = request.size;
+                cursor += size_t(tile.size / minTileSize) *
+                          (tile.size / minTileSize);
+                if (spot)
+                    spotTile(tile, spotLight);
+                else
+                    faceTile(tile, pointLights[request.light - 1], face);
+                tiles.push_back(tile);
+            }
+            lastSizes[request.light] = request.size;
+            if (spot)
+                spotLight.shadow = first;
+            else
+                pointLights[request.light - 1].shadow = first;
+        }
+
+        // Cached contents survive only in the place they were drawn.
+        std::vector<bool> kept(cache.size(), false);
+        for (const Tile &tile : tiles) {
+            if (size_t(tile.key) >= cache.size()) continue;
+            const Tile &cached = cache[tile.key];
+            kept[tile.key] = cached.offset == tile.offset &&
+                             cached.size == tile.size;
+        }
+        for (size_t key = 0; key < cache.size(); key++)
+            if (!kept[key]) cache[key].valid = false;
+    }
+
+    // A caster moved out of or into bounds; cached tiles whose volume it
+    // touches fall due. Without bounds, every tile falls due.
+    void invalidate(const Bounds &bounds) {
+        for (Tile &cached : cache)
+            if (cached.valid && cached.frustum.intersects(bounds))
+                cached.valid = false;
+    }
+    void invalidate() {
+        for (Tile &cached : cache) cached.valid = false;
+    }
+
+    int count() const { return tiles.size(); }
+    bool due(int tile) const {
+        const Tile &current = tiles[tile];
+        if (size_t(current.key) >= cache.size()) return true;
+        const Tile &cached = cache[current.key];
+        return !cached.valid || cached.view != current.view ||
+               cached.projection != current.projection;
+    }
+    Frustum casterFrustum(int tile) const { return tiles[tile].frustum; }
+
+    // Redraw a due tile. draw() runs with the tile's light view and
+    // projection in camera, so any depth-only shader reading the Camera
+    // block draws the casters; update camera again afterwards.
+    template <typename Draw>
+    void render(int tile, UniformBuffer<CameraBlock> &camera, Draw &&draw) {
+        GLState &state = GLState::instance();
+        GLint viewport[4], previous;
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        state.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        const Tile &current = tiles[tile];
+        glViewport(current.offset.x, current.offset.y, current.size,
+                   current.size);
+        state.enable(GL_SCISSOR_TEST);
+        glScissor(current.offset.x, current.offset.y, current.size,
+                  current.size);
+        state.enable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        state.disable(GL_SCISSOR_TEST);
+        state.enable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(slopeBias, constantBias);
+
+        camera.update({current.view, current.projection, current.position});
+        draw();
+
+        state.disable(GL_POLYGON_OFFSET_FILL);
+        state.bindFramebuffer(GL_FRAMEBUFFER, previous);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        if (size_t(current.key) >= cache.size())
+            cache.resize(current.key + 1);
+        cache[current.key] = current;
+        cache[current.key].valid = true;
+    }
+
+    // Upload the tiles the shadow fields point at and bind the atlas.
+    void apply() {
+        std::vector<ShadowTile> data(tiles.size());
+        for (size_t i = 0; i < tiles.size(); i++) {
+            const Tile &tile = tiles[i];
+            // From clip space to the tile's atlas coordinates and depth.
+            glm::vec2 min = glm::vec2(tile.offset) / float(resolution);
+            glm::vec2 extent = glm::vec2(float(tile.size) / resolution);
+            glm::mat4 bias =
+                glm::translate(glm::mat4(1.0f),
+                               glm::vec3(min + extent * 0.5f, 0.5f)) *
+                glm::scale(glm::mat4(1.0f),
+                           glm::vec3(extent * 0.5f, 0.5f));
+            glm::vec2 texel = glm::vec2(0.5f / resolution);
+            data[i].matrix = bias * tile.projection * tile.view;
+            data[i].rect = glm::vec4(min + texel, min + extent - texel);
+            data[i].texelScale = tile.texelScale;
+        }
+
+        GLState &state = GLState::instance();
+        state.bindBuffer(GL_SHADER_STORAGE_BUFFER, tileBuffer);
+        size_t size = std::max<size_t>(data.size(), 1) * sizeof(ShadowTile);
+        if (size > tileCapacity) {
+            tileCapacity = size;
+            glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr,
+                         GL_DYNAMIC_DRAW);
+        }
+        if (!data.empty())
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                            data.size() * sizeof(ShadowTile), data.data());
+        state.bindBufferBase(GL_SHADER_STORAGE_BUFFER, SHADOW_TILES_BINDING,
+                             tileBuffer);
+        state.bindTexture(SHADOW_ATLAS_UNIT, GL_TEXTURE_2D, texture);
+    }
+
+    GLuint getTexture() const { return texture; }
+
+   private:
+    static constexpr int SPOT_LIGHT = 0;
+
+    // A light's claim on the atlas; point light i is light i + 1.
+    struct Request {
+        int light;
+        int size;
+        float pixels;
+        float distance;
+
+        size_t area() const {
+            return size_t(size) * size * (light == SPOT_LIGHT ? 1 : 6);
+        }
+    };
+
+    // key is light * 6 + face.
+    struct Tile {
+        int key = 0;
+        glm::ivec2 offset = glm::ivec2(0);
+        int size = 0;
+        glm::mat4 view = glm::mat4(1.0f);
+        glm::mat4 projection = glm::mat4(1.0f);
+        glm::vec3 position = glm::vec3(0.0f);
+        float texelScale = 0.0f;
+        Frustum frustum;
+        bool valid = false;
+    };
+
+    GLuint framebuffer = 0, texture = 0, tileBuffer = 0;
+    int resolution = 0;
+    size_t tileCapacity = 0;
+    std::vector<Request> requests;
+    // This frame's tiles, and what the atlas holds by key.
+    std::vector<Tile> tiles, cache;
+    std::vector<int> lastSizes;
+
+    int tileSize(float pixels) const {
+        int size = minTileSize;
+        while (size < maxTileSize && size * 1.41421356f < pixels) size *= 2;
+        return std::min(size, resolution);
+    }
+
+    // Position of the index-th minimum size tile along the Z-order curve.
+    static glm::ivec2 cell(size_t index) {
+        glm::ivec2 cell(0);
+        for (int bit = 0; index >> 2 * bit; bit++) {
+            cell.x |= int(index >> 2 * bit & 1) << bit;
+            cell.y |= int(index >> (2 * bit + 1) & 1) << bit;
+        }
+        return cell;
+    }
+
+    void faceTile(Tile &tile, const PointLight &light, int face) const {
+        // +X, -X, +Y, -Y, +Z, -Z, as shaders/lighting.glsl picks them.
+        static const glm::vec3 directions[6] = {{1, 0, 0},  {-1, 0, 0},
+                                                {0, 1, 0},  {0, -1, 0},
+                                                {0, 0, 1},  {0, 0, -1}};
+        static const glm::vec3 ups[6] = {{0, -1, 0}, {0, -1, 0},
+                                         {0, 0, 1},  {0, 0, -1},
+                                         {0, -1, 0}, {0, -1, 0}};
+        float range = std::min(lightRange(light, LightClusters::cutoff),
+                               maxDistance);
+        tile.position = light.position;
+        tile.view = glm::lookAt(light.position,
+                                light.position + directions[face], ups[face]);
+        tile.projection =
+            glm::perspective(glm::radians(90.0f), 1.0f, zNear, range);
+        tile.texelScale = 2.0f / tile.size;
+        tile.frustum = Frustum::fromMatrix(tile.projection * tile.view);
+    }
+
+    void spotTile(Tile &tile, const SpotLight &light) const {
+        glm::vec3 direction = glm::normalize(light.direction);
+        glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(1, 0, 0)
+                                                     : glm::vec3(0, 1, 0);
+        float range = std::min(lightRange(light, LightClusters::cutoff),
+                               maxDistance);
+        float angle = std::min(2.0f * std::acos(light.outerCutoff),
+                               glm::radians(170.0f));
+        tile.position = light.position;
+        tile.view =
+            glm::lookAt(light.position, light.position + direction, up);
+        tile.projection = glm::perspective(angle, 1.0f, zNear, range);
+        tile.texelScale = 2.0f * std::tan(angle * 0.5f) / tile.size;
+        tile.frustum = Frustum::fromMatrix(tile.projection * tile.view);
+    }
+};
+
+#endif
@@ -0,0 +1,380 @@
+#ifndef SOFTWARE_OCCLUSION_H
+#define SOFTWARE_OCCLUSION_H
+
+#include <glm/glm.hpp>
+
+#include <frustum.h>
+#include <thread_pool.h>
+#include <vertex_format.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <vector>
+
+// Low-poly stand-in for an object, which must lie inside the object it
+// represents.
+struct Occluder {
+    std::vector<glm::vec3> positions;
+    std::vector<unsigned int> indices;
+
+    // For objects that fill their bounds, such as crates and buildings.
+    static Occluder box(const Bounds &bounds) {
+        Occluder occluder;
+        for (int corner = 0; corner < 8; corner++)
+            occluder.positions.push_back(
+                {corner & 1 ? bounds.max.x : bounds.min.x,
+                 corner & 2 ? bounds.max.y : bounds.min.y,
+                 corner & 4 ? bounds.max.z : bounds.min.z});
+        occluder.indices = {0, 2, 1, 1, 2, 3, 4, 5, 6, 5, 7, 6,
+                            0, 1, 4, 1, 5, 4, 2, 6, 3, 3, 6, 7,
+                            0, 4, 2, 2, 4, 6, 1, 3, 5, 3, 7, 5};
+        return occluder;
+    }
+};
+
+// Occlusion culling on the CPU, so hidden objects are rejected before
+// anything is submitted and without reading back from the GPU. Occluders
+// are rasterized into a small buffer of 1 / w, the nearest occluder
+// winning, with the screen split into bands that render in parallel.
+// Bounds are then tested against it. Like any low resolution occlusion
+// buffer it can hide objects seen only through gaps narrower than one of
+// its pixels. Per frame:
+//
+//     occlusion.begin(projection * view);
+//     occlusion.add(occluder, model);
+//     occlusion.render();
+//     occlusion.cull(bounds, visible);
+class SoftwareOcclusion {
+   public:
+    static inline bool simd = true;
+
+    // Triangles are clipped where w drops below this.
+    static constexpr float NEAR_W = 1e-3f;
+    // Tested bounds are brought this much closer, relative to their depth,
+    // so an object is never hidden by its own occluder.
+    static constexpr float DEPTH_BIAS = 1e-4f;
+    // Side of the square tiles that keep the farthest depth under them.
+    static constexpr int TILE_SIZE = 8;
+
+    SoftwareOcclusion(ThreadPool &pool, int width = 256, int height = 128)
+        : pool(pool),
+          bufferWidth((std::max(width, 4) + 3) & ~3),
+          bufferHeight(std::max(height, 1)),
+          buffer(size_t(bufferWidth) * bufferHeight, 0.0f),
+          tilesWide((bufferWidth + TILE_SIZE - 1) / TILE_SIZE),
+          tilesHigh((bufferHeight + TILE_SIZE - 1) / TILE_SIZE),
+          tiles(size_t(tilesWide) * tilesHigh, 0.0f) {}
+
+    // Clears the occluders and the buffer.
+    void begin(const glm::mat4 &viewProjection) {
+        this->viewProjection = viewProjection;
+        occluders.clear();
+        std::fill(buffer.begin(), buffer.end(), 0.0f);
+        std::fill(tiles.begin(), tiles.end(), 0.0f);
+    }
+    // occluder must stay alive until render() returns.
+    void add(const Occluder &occluder, const glm::mat4 &model) {
+        occluders.push_back({&occluder, viewProjection * model});
+    }
+
+    void render() {
+        size_t tasks = std::min(occluders.size(), pool.size() + 1);
+        binned.resize(std::max<size_t>(tasks, 1));
+        for (std::vector<Triangle> &triangles : binned) triangles.clear();
+        parallel(tasks, [this, tasks](size_t task) {
+            for (size_t i = task; i < occluders.size(); i += tasks)
+                transform(occluders[i], binned[task]);
+        });
+        lastTriangles = 0;
+        for (const std::vector<Triangle> &triangles : binned)
+            lastTriangles += triangles.size();
+
+        size_t bands = std::min<size_t>(pool.size() + 1, bufferHeight);
+        parallel(bands, [this, bands](size_t band) {
+            int first = bufferHeight * band / bands;
+            int last = bufferHeight * (band + 1) / bands;
+            for (const std::vector<Triangle> &triangles : binned) {
+                for (const Triangle &triangle : triangles)
+                    rasterize(triangle, first, last);
+            }
+        });
+
+        size_t tileBands = std::min<size_t>(pool.size() + 1, tilesHigh);
+        parallel(tileBands, [this, tileBands](size_t band) {
+            for (int tileY = tilesHigh * band / tileBands;
+                 tileY < int(tilesHigh * (band + 1) / tileBands); tileY++)
+                reduceTiles(tileY);
+        });
+    }
+
+    // Whether any part of bounds may be in front of the occluders.
+    bool visible(const Bounds &bounds) const {
+        // The corners are one corner plus any mix of the three edges.
+        glm::vec4 origin = viewProjection * glm::vec4(bounds.min, 1.0f);
+        glm::vec3 size = bounds.max - bounds.min;
+        glm::vec4 edges[3] = {viewProjection[0] * size.x,
+                              viewProjection[1] * size.y,
+                              viewProjection[2] * size.z};
+        glm::vec2 min(std::numeric_limits<float>::infinity());
+        glm::vec2 max(-std::numeric_limits<float>::infinity());
+        float depth = 0.0f;
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec4 clip = origin;
+            for (int axis = 0; axis < 3; axis++)
+                if (corner >> axis & 1) clip += edges[axis];
+            if (clip.w < NEAR_W) return true;
+            glm::vec2 screen = toScreen(clip);
+            min = glm::min(min, screen);
+            max = glm::max(max, screen);
+            depth = glm::max(depth, 1.0f / clip.w);
+        }
+        depth *= 1.0f + DEPTH_BIAS;
+        if (max.x < 0.0f || max.y < 0.0f || min.x >= bufferWidth ||
+            min.y >= bufferHeight)
+            return false;
+        int x0 = int(glm::max(min.x, 0.0f));
+        int y0 = int(glm::max(min.y, 0.0f));
+        int x1 = int(glm::min(max.x, bufferWidth - 1.0f));
+        int y1 = int(glm::min(max.y, bufferHeight - 1.0f));
+
+        // Tiles whose farthest occluder is in front of the box are hidden
+        // as a whole; only the others are scanned pixel by pixel.
+        for (int tileY = y0 / TILE_SIZE; tileY <= y1 / TILE_SIZE; tileY++) {
+            for (int tileX = x0 / TILE_SIZE; tileX <= x1 / TILE_SIZE;
+                 tileX++) {
+                if (tiles[size_t(tileY) * tilesWide + tileX] > depth)
+                    continue;
+                if (closer(std::max(x0, tileX * TILE_SIZE),
+                           std::min(x1, tileX * TILE_SIZE + TILE_SIZE - 1),
+                           std::max(y0, tileY * TILE_SIZE),
+                           std::min(y1, tileY * TILE_SIZE + TILE_SIZE - 1),
+                           depth))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Indices of the bounds that may be visible, in order.
+    void cull(const std::vector<Bounds> &bounds,
+              std::vector<std::uint32_t> &visible) {
+        flags.assign(bounds.size(), 0);
+        size_t tasks = std::min(pool.size() + 1, (bounds.size() + 63) / 64);
+        parallel(tasks, [&](size_t task) {
+            size_t first = bounds.size() * task / tasks;
+            size_t last = bounds.size() * (task + 1) / tasks;
+            for (size_t i = first; i < last; i++)
+                flags[i] = this->visible(bounds[i]);
+        });
+        visible.clear();
+        for (size_t i = 0; i < bounds.size(); i++)
+            if (flags[i]) visible.push_back(i);
+    }
+
+    int width() const { return bufferWidth; }
+    int height() const { return bufferHeight; }
+    // Row-major from the bottom row, 0 where no occluder was drawn.
+    const std::vector<float> &depth() const { return buffer; }
+    // Triangles rasterized by the last render(), after clipping.
+    size_t triangles() const { return lastTriangles; }
+
+   private:
+    struct Instance {
+        const Occluder *occluder;
+        glm::mat4 transform;
+    };
+    // Screen position and 1 / w of each corner.
+    struct Triangle {
+        glm::vec3 vertices[3];
+    };
+
+    ThreadPool &pool;
+    int bufferWidth, bufferHeight;
+    // Rows are a multiple of four floats, so SSE never straddles two.
+    std::vector<float> buffer;
+    int tilesWide, tilesHigh;
+    std::vector<float> tiles;
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    std::vector<Instance> occluders;
+    std::vector<std::vector<Triangle>> binned;
+    std::vector<std::uint8_t> flags;
+    size_t lastTriangles = 0;
+
+    // Runs task(0 .. count - 1), the last one on the calling thread.
+    template <typename F>
+    void parallel(size_t count, F &&task) {
+        if (count == 0) return;
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i + 1 < count; i++)
+            futures.push_back(pool.submit([&task, i] { task(i); }));
+        task(count - 1);
+        for (std::future<void> &future : futures) future.get();
+    }
+
+    // Whether any pixel in [x0, x1] x [y0, y1] is farther than depth.
+    bool closer(int x0, int x1, int y0, int y1, float depth) const {
+        for (int y = y0; y <= y1; y++) {
+            const float *row = &buffer[size_t(y) * bufferWidth];
+            int x = x0;
+#ifdef FRUSTUM_SSE
+            if (simd) {
+                __m128 boxDepth = _mm_set1_ps(depth);
+                for (x = x0 & ~3; x <= x1; x += 4) {
+                    __m128 lanes = _mm_add_ps(_mm_set1_ps(float(x)),
+                                              _mm_setr_ps(0, 1, 2, 3));
+                    __m128 inside = _mm_and_ps(
+                        _mm_cmpge_ps(lanes, _mm_set1_ps(float(x0))),
+                        _mm_cmple_ps(lanes, _mm_set1_ps(float(x1))));
+                    __m128 behind =
+                        _mm_cmplt_ps(_mm_loadu_ps(row + x), boxDepth);
+                    if (_mm_movemask_ps(_mm_and_ps(inside, behind)))
+                        return true;
+                }
+            }
+#endif
+            for (; x <= x1; x++)
+                if (row[x] < depth) return true;
+        }
+        return false;
+    }
+
+    void reduceTiles(int tileY) {
+        int y0 = tileY * TILE_SIZE;
+        int y1 = std::min(y0 + TILE_SIZE, bufferHeight);
+        for (int tileX = 0; tileX < tilesWide; tileX++) {
+            int x0 = tileX * TILE_SIZE;
+            int x1 = std::min(x0 + TILE_SIZE, bufferWidth);
+            float farthest = std::numeric_limits<float>::infinity();
+            for (int y = y0; y < y1; y++) {
+                const float *row = &buffer[size_t(y) * bufferWidth];
+                for (int x = x0; x < x1; x++)
+                    farthest = glm::min(farthest, row[x]);
+            }
+            tiles[size_t(tileY) * tilesWide + tileX] = farthest;
+        }
+    }
+
+    glm::vec2 toScreen(const glm::vec4 &clip) const {
+        glm::vec2 ndc = glm::vec2(clip) / clip.w;
+        return (ndc * 0.5f + 0.5f) *
+               glm::vec2(float(bufferWidth), float(bufferHeight));
+    }
+
+    void transform(const Instance &instance,
+                   std::vector<Triangle> &triangles) const {
+        const Occluder &occluder = *instance.occluder;
+        std::vector<glm::vec4> clip(occluder.positions.size());
+        for (size_t i = 0; i < clip.size(); i++)
+            clip[i] = instance.transform * glm::vec4(occluder.positions[i], 1);
+        for (size_t i = 0; i + 2 < occluder.indices.size(); i += 3) {
+            glm::vec4 corners[3] = {clip[occluder.indices[i]],
+                                    clip[occluder.indices[i + 1]],
+                                    clip[occluder.indices[i + 2]]};
+            clipNear(corners, triangles);
+        }
+    }
+
+    // Sutherland-Hodgman against w = NEAR_W, giving up to two triangles.
+    void clipNear(const glm::vec4 (&corners)[3],
+                  std::vector<Triangle> &triangles) const {
+        glm::vec4 polygon[4];
+        int count = 0;
+        for (int i = 0; i < 3; i++) {
+            const glm::vec4 &a = corners[i], &b = corners[(i + 1) % 3];
+            bool aInside = a.w >= NEAR_W, bInside = b.w >= NEAR_W;
+            if (aInside) polygon[count++] = a;
+            if (aInside != bInside)
+                polygon[count++] = glm::mix(a, b, (NEAR_W - a.w) / (b.w - a.w));
+        }
+        for (int i = 1; i + 1 < count; i++) {
+            Triangle triangle;
+            const glm::vec4 *fan[3] = {&polygon[0], &polygon[i],
+                                       &polygon[i + 1]};
+            for (int j = 0; j < 3; j++)
+                triangle.vertices[j] =
+                    glm::vec3(toScreen(*fan[j]), 1.0f / fan[j]->w);
+            triangles.push_back(triangle);
+        }
+    }
+
+    // Writes the rows [first, last) of triangle, sampling pixel centres.
+    void rasterize(const Triangle &triangle, int first, int last) {
+        glm::vec3 a = triangle.vertices[0], b = triangle.vertices[1],
+                  c = triangle.vertices[2];
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (area == 0.0f) return;
+        if (area < 0.0f) {
+            std::swap(b, c);
+            area = -area;
+        }
+        glm::vec2 min = glm::min(glm::vec2(a), glm::vec2(glm::min(b, c)));
+        glm::vec2 max = glm::max(glm::vec2(a), glm::vec2(glm::max(b, c)));
+        int x0 = int(glm::clamp(glm::floor(min.x), 0.0f, float(bufferWidth)));
+        int x1 = int(glm::clamp(glm::ceil(max.x), 0.0f, float(bufferWidth)));
+        int y0 = int(glm::clamp(glm::floor(min.y), float(first), float(last)));
+        int y1 = int(glm::clamp(glm::ceil(max.y), float(first), float(last)));
+        if (x0 >= x1 || y0 >= y1) return;
+
+        // Edge functions and 1 / w as planes e(x, y) = A x + B y + C, so a
+        // pixel is covered when all three edges are non-negative.
+        glm::vec3 edgeA(a.y - b.y, b.y - c.y, c.y - a.y);
+        glm::vec3 edgeB(b.x - a.x, c.x - b.x, a.x - c.x);
+        glm::vec3 edgeC(a.x * b.y - a.y * b.x, b.x * c.y - b.y * c.x,
+                        c.x * a.y - c.y * a.x);
+        // Barycentric weights of a, b and c are the edges opposite them.
+        glm::vec3 weights = glm::vec3(c.z, a.z, b.z) / area;
+        float depthA = glm::dot(edgeA, weights);
+        float depthB = glm::dot(edgeB, weights);
+        float depthC = glm::dot(edgeC, weights);
+
+        for (int y = y0; y < y1; y++) {
+            float *row = &buffer[size_t(y) * bufferWidth];
+            float py = y + 0.5f;
+            glm::vec3 rowEdge = edgeB * py + edgeC;
+            float rowDepth = depthB * py + depthC;
+            int x = x0;
+#ifdef FRUSTUM_SSE
+            if (simd) {
+                __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+                for (x = x0 & ~3; x < x1; x += 4) {
+                    __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), offsets);
+                    __m128 e0 = _mm_add_ps(
+                        _mm_mul_ps(_mm_set1_ps(edgeA.x), px),
+                        _mm_set1_ps(rowEdge.x));
+                    __m128 e1 = _mm_add_ps(
+                        _mm_mul_ps(_mm_set1_ps(edgeA.y), px),
+                        _mm_set1_ps(rowEdge.y));
+                    __m128 e2 = _mm_add_ps(
+                        _mm_mul_ps(_mm_set1_ps(edgeA.z), px),
+                        _mm_set1_ps(rowEdge.z));
+                    __m128 zero = _mm_setzero_ps();
+                    __m128 covered = _mm_and_ps(
+                        _mm_and_ps(_mm_cmpge_ps(e0, zero),
+                                   _mm_cmpge_ps(e1, zero)),
+                        _mm_cmpge_ps(e2, zero));
+                    if (!_mm_movemask_ps(covered)) continue;
+                    __m128 depth = _mm_add_ps(
+                        _mm_mul_ps(_mm_set1_ps(depthA), px),
+                        _mm_set1_ps(rowDepth));
+                    // Depths are positive, so masked lanes leave the
+                    // buffer as it is.
+                    _mm_storeu_ps(row + x,
+                                  _mm_max_ps(_mm_loadu_ps(row + x),
+                                             _mm_and_ps(covered, depth)));
+                }
+            }
+#endif
+            for (; x < x1; x++) {
+                float px = x + 0.5f;
+                glm::vec3 edge = edgeA * px + rowEdge;
+                if (edge.x < 0.0f || edge.y < 0.0f || edge.z < 0.0f)
+                    continue;
+                row[x] = glm::max(row[x], depthA * px + rowDepth);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <GL/glew.h>
+
+#include <gl_state.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Process-wide table of loaded textures, keyed by normalized file path and
+// optionally by a hash of the decoded pixels, so identical images reached
+// through different paths share one upload.
+//
+// Lookups may come from any thread. Textures are only deleted by purge(),
+// which must run on the GL thread; release() merely drops a reference.
+class TextureCache {
+   public:
+    static inline bool hashContents = false;
+
+    static TextureCache &instance() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    static std::string normalize(const std::string &path) {
+        std::string generic = path;
+        std::replace(generic.begin(), generic.end(), '\\', '/');
+        return std::filesystem::path(generic).lexically_normal().string();
+    }
+
+    // Returns the texture for key with an added reference, or 0.
+    GLuint acquire(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = paths.find(key);
+        if (it == paths.end()) return 0;
+        entries[it->second].refs++;
+        return it->second;
+    }
+
+    // As above, but also matches by content. A hit is remembered under key.
+    GLuint acquire(const std::string &key, std::uint64_t hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = paths.find(key);
+        if (it == paths.end() && hash != 0) {
+            auto match = hashes.find(hash);
+            if (match == hashes.end()) return 0;
+            it = paths.emplace(key, match->second).first;
+            entries[match->second].keys.push_back(key);
+        }
+        if (it == paths.end()) return 0;
+        entries[it->second].refs++;
+        return it->second;
+    }
+
+    // Register a freshly uploaded texture with one reference. If another
+    // thread got there first, id is deleted and the existing one returned,
+    // so this must be called on the GL thread.
+    GLuint insert(const std::string &key, GLuint id, std::uint64_t hash = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = paths.find(key);
+        if (it == paths.end() && hash != 0) {
+            auto match = hashes.find(hash);
+            if (match != hashes.end()) {
+                it = paths.emplace(key, match->second).first;
+                entries[match->second].keys.push_back(key);
+            }
+        }
+        if (it != paths.end()) {
+            GLState::instance().deleteTexture(id);
+            entries[it->second].refs++;
+            return it->second;
+        }
+        paths.emplace(key, id);
+        Entry &entry = entries[id];
+        entry.refs = 1;
+        entry.hash = hash;
+        entry.keys.push_back(key);
+        if (hash != 0) hashes.emplace(hash, id);
+        return id;
+    }
+
+    void release(GLuint id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it != entries.end() && it->second.refs > 0) it->second.refs--;
+    }
+
+    // Delete every texture nobody references any more.
+    void purge() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->second.refs > 0) {
+                ++it;
+                continue;
+            }
+            for (const std::string &key : it->second.keys) paths.erase(key);
+            if (it->second.hash != 0) hashes.erase(it->second.hash);
+            GLState::instance().deleteTexture(it->first);
+            it = entries.erase(it);
+        }
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+   private:
+    struct Entry {
+        size_t refs = 0;
+        std::uint64_t hash = 0;
+        std::vector<std::string> keys;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, GLuint> paths;
+    std::unordered_map<std::uint64_t, GLuint> hashes;
+    std::unordered_map<GLuint, Entry> entries;
+
+    TextureCache() = default;
+};
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef TEXTURE_COMPRESSOR_H
+#define TEXTURE_COMPRESSOR_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Offline encoder for the block formats the DDS loader reads back. Touches
+// no GL state. Input is always tightly packed RGBA8.
+enum BlockFormat { BC1, BC3 };
+
+struct RGBAImage {
+    int width = 0, height = 0;
+    std::vector<unsigned char> pixels;
+};
+
+// 2x2 box filter; odd edges reuse the last row or column.
+inline RGBAImage downsample(const RGBAImage &image) {
+    RGBAImage result;
+    result.width = std::max(1, image.width / 2);
+    result.height = std::max(1, image.height / 2);
+    result.pixels.resize(size_t(result.width) * result.height * 4);
+    for (int y = 0; y < result.height; y++) {
+        int y0 = std::min(y * 2, image.height - 1);
+        int y1 = std::min(y * 2 + 1, image.height - 1);
+        for (int x = 0; x < result.width; x++) {
+            int x0 = std::min(x * 2, image.width - 1);
+            int x1 = std::min(x * 2 + 1, image.width - 1);
+            for (int c = 0; c < 4; c++) {
+                auto at = [&](int px, int py) {
+                    return image.pixels[(size_t(py) * image.width + px) * 4 +
+                                        c];
+                };
+                int sum = at(x0, y0) + at(x1, y0) + at(x0, y1) + at(x1, y1);
+                result.pixels[(size_t(y) * result.width + x) * 4 + c] =
+                    (sum + 2) / 4;
+            }
+        }
+    }
+    return result;
+}
+
+inline std::vector<RGBAImage> buildMipChain(RGBAImage image) {
+    std::vector<RGBAImage> chain;
+    chain.push_back(std::move(image));
+    while (chain.back().width > 1 || chain.back().height > 1)
+        chain.push_back(downsample(chain.back()));
+    return chain;
+}
+
+namespace detail {
+
+inline std::uint16_t pack565(const glm::vec3 &color) {
+    glm::vec3 c = glm::clamp(color, 0.0f, 255.0f);
+    return (std::uint16_t(c.r * 31.0f / 255.0f + 0.5f) << 11) |
+           (std::uint16_t(c.g * 63.0f / 255.0f + 0.5f) << 5) |
+           std::uint16_t(c.b * 31.0f / 255.0f + 0.5f);
+}
+
+inline glm::vec3 unpack565(std::uint16_t color) {
+    return glm::vec3(((color >> 11) & 31) * 255.0f / 31.0f,
+                     ((color >> 5) & 63) * 255.0f / 63.0f,
+                     (color & 31) * 255.0f / 31.0f);
+}
+
+// Four-colour block with endpoints on the principal axis of the colours.
+inline void encodeColorBlock(const unsigned char *rgba, unsigned char *out) {
+    glm::vec3 colors[16], mean(0.0f);
+    for (int i = 0; i < 16; i++) {
+        colors[i] = glm::vec3(rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2]);
+        mean += colors[i] / 16.0f;
+    }
+    glm::mat3 covariance(0.0f);
+    for (const glm::vec3 &color : colors) {
+        glm::vec3 d = color - mean;
+        covariance += glm::outerProduct(d, d);
+    }
+    glm::vec3 axis(1.0f);
+    for (int i = 0; i < 8; i++) {
+        axis = covariance * axis;
+        float length = glm::length(axis);
+        if (length < 1e-6f) break;
+        axis /= length;
+    }
+    float low = 0.0f, high = 0.0f;
+    for (const glm::vec3 &color : colors) {
+        float t = glm::dot(color - mean, axis);
+        low = std::min(low, t);
+        high = std::max(high, t);
+    }
+    std::uint16_t c0 = pack565(mean + axis * high);
+    std::uint16_t c1 = pack565(mean + axis * low);
+    if (c0 < c1) std::swap(c0, c1);
+
+    std::uint32_t indices = 0;
+    if (c0 != c1) {
+        glm::vec3 palette[4] = {unpack565(c0), unpack565(c1)};
+        palette[2] = (palette[0] * 2.0f + palette[1]) / 3.0f;
+        palette[3] = (palette[0] + palette[1] * 2.0f) / 3.0f;
+        for (int i = 0; i < 16; i++) {
+            std::uint32_t best = 0;
+            float bestDistance = 1e30f;
+            for (std::uint32_t j = 0; j < 4; j++) {
+                glm::vec3 d = colors[i] - palette[j];
+                float distance = glm::dot(d, d);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    best = j;
+                }
+            }
+            indices |= best << (i * 2);
+        }
+    }
+    std::memcpy(out, &c0, 2);
+    std::memcpy(out + 2, &c1, 2);
+    std::memcpy(out + 4, &indices, 4);
+}
+
+// Eight-value alpha block between the block's min and max alpha.
+inline void encodeAlphaBlock(const unsigned char *rgba, unsigned char *out) {
+    int a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; i++) {
+        a0 = std::max(a0, int(rgba[i * 4 + 3]));
+        a1 = std::min(a1, int(rgba[i * 4 + 3]));
+    }
+    std::uint64_t bits = 0;
+    if (a0 != a1) {
+        int palette[8] = {a0, a1};
+        for (int j = 1; j < 7; j++)
+            palette[j + 1] = ((7 - j) * a0 + j * a1 + 3) / 7;
+        for (int i = 0; i < 16; i++) {
+            int alpha = rgba[i * 4 + 3];
+            std::uint64_t best = 0;
+            for (int j = 1; j < 8; j++) {
+                if (std::abs(palette[j] - alpha) <
+                    std::abs(palette[best] - alpha))
+                    best = j;
+            }
+            bits |= best << (i * 3);
+        }
+    }
+    out[0] = a0;
+    out[1] = a1;
+    for (int i = 0; i < 6; i++) out[2 + i] = (bits >> (i * 8)) & 0xff;
+}
+
+}  // namespace detail
+
+inline size_t blockSize(BlockFormat format) { return format == BC1 ? 8 : 16; }
+
+inline std::vector<unsigned char> compressImage(const RGBAImage &image,
+                                                BlockFormat format) {
+    int blocksX = (image.width + 3) / 4, blocksY = (image.height + 3) / 4;
+    std::vector<unsigned char> result(size_t(blocksX) * blocksY *
+                                      blockSize(format));
+    unsigned char *out = result.data();
+    unsigned char block[64];
+    for (int by = 0; by < blocksY; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            // Blocks overhanging the edge repeat the border texels.
+            for (int y = 0; y < 4; y++) {
+                int py = std::min(by * 4 + y, image.height - 1);
+                for (int x = 0; x < 4; x++) {
+                    int px = std::min(bx * 4 + x, image.width - 1);
+                    std::memcpy(
+                        block + (y * 4 + x) * 4,
+                        &image.pixels[(size_t(py) * image.width + px) * 4], 4);
+                }
+            }
+            if (format == BC3) {
+                detail::encodeAlphaBlock(block, out);
+                out += 8;
+            }
+            detail::encodeColorBlock(block, out);
+            out += 8;
+        }
+    }
+    return result;
+}
+
+inline bool writeDDS(const std::string &file, BlockFormat format, int width,
+                     int height,
+                     const std::vector<std::vector<unsigned char>> &levels) {
+    std::uint32_t header[32] = {};
+    std::memcpy(&header[0], "DDS ", 4);
+    header[1] = 124;
+    // CAPS | HEIGHT | WIDTH | PIXELFORMAT | MIPMAPCOUNT | LINEARSIZE
+    header[2] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;
+    header[3] = height;
+    header[4] = width;
+    header[5] = levels.empty() ? 0 : levels[0].size();
+    header[7] = levels.size();
+    header[19] = 32;
+    header[20] = 0x4;  // DDPF_FOURCC
+    std::memcpy(&header[21], format == BC1 ? "DXT1" : "DXT5", 4);
+    // TEXTURE | MIPMAP | COMPLEX
+    header[27] = 0x1000 | (levels.size() > 1 ? 0x400000 | 0x8 : 0);
+
+    // Like MeshCache::write(), through a randomly named temporary so
+    // concurrent bakes of the same output never share a file.
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), ".%08x.tmp",
+                  static_cast<unsigned int>(std::random_device{}()));
+    std::string temporary = file + suffix;
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        for (const std::vector<unsigned char> &level : levels)
+            out.write(reinterpret_cast<const char *>(level.data()),
+                      level.size());
+        if (!out) {
+            std::cerr << "ERROR WRITING TEXTURE: " << file << std::endl;
+            out.close();
+            std::error_code ignored;
+            std::filesystem::remove(temporary, ignored);
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, file, error);
+    bool renamed = !error;
+    if (!renamed) {
+        std::cerr << "ERROR WRITING TEXTURE: " << file << std::endl;
+        std::error_code ignored;
+        std::filesystem::remove(temporary, ignored);
+    }
+    return renamed;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool {
+   public:
+    ThreadPool(unsigned int threads = defaultThreads()) {
+        for (unsigned int i = 0; i < threads; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (std::thread &worker : workers) worker.join();
+    }
+
+    template <typename F>
+    auto submit(F &&task) -> std::future<std::invoke_result_t<F>> {
+        using Result = std::invoke_result_t<F>;
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(
+            std::forward<F>(task));
+        std::future<Result> future = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push([packaged] { (*packaged)(); });
+        }
+        condition.notify_one();
+        return future;
+    }
+    size_t size() const { return workers.size(); }
+
+    // Leave one core for the render thread.
+    static unsigned int defaultThreads() {
+        unsigned int cores = std::thread::hardware_concurrency();
+        return std::max(1u, cores > 1 ? cores - 1 : 1u);
+    }
+
+   private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock,
+                               [this] { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+};
+
+#endif
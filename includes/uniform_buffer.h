@@ -0,0 +1,67 @@
+#ifndef UNIFORM_BUFFER_H
+#define UNIFORM_BUFFER_H
+
+#include <GL/glew.h>
+
+#include <gl_state.h>
+
+#include <string>
+
+// Fixed binding points shared by every program. Shader binds any active
+// block with a matching name when it is linked.
+enum UniformBinding { CAMERA_BINDING = 0, LIGHTS_BINDING = 1 };
+
+inline GLint uniformBinding(const std::string &block) {
+    if (block == "Camera") return CAMERA_BINDING;
+    if (block == "Lights") return LIGHTS_BINDING;
+    return -1;
+}
+
+// Fixed texture units of samplers shared by every program, above those
+// materials use. Shader points any active sampler with a matching name at
+// its unit when it is linked.
+enum TextureUnit { SHADOW_MAP_UNIT = 8, SHADOW_ATLAS_UNIT };
+
+inline GLint textureUnit(const std::string &sampler) {
+    if (sampler == "shadowMap") return SHADOW_MAP_UNIT;
+    if (sampler == "shadowAtlas") return SHADOW_ATLAS_UNIT;
+    return -1;
+}
+
+// Fixed shader storage binding points, given in the shaders with
+// layout (binding = N).
+enum StorageBinding {
+    DRAWS_BINDING = 0,
+    COMMANDS_BINDING,
+    BOUNDS_BINDING,
+    POINT_LIGHTS_BINDING,
+    CLUSTER_BOUNDS_BINDING,
+    CLUSTER_COUNTS_BINDING,
+    CLUSTER_LIGHTS_BINDING,
+    SHADOW_TILES_BINDING
+};
+
+// T must mirror the std140 layout of the GLSL block it backs.
+template <typename T>
+class UniformBuffer {
+   public:
+    unsigned int id;
+    GLuint binding;
+
+    UniformBuffer(GLuint binding) : binding(binding) {
+        glGenBuffers(1, &id);
+        GLState &state = GLState::instance();
+        state.bindBuffer(GL_UNIFORM_BUFFER, id);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(T), nullptr, GL_DYNAMIC_DRAW);
+        state.bindBufferBase(GL_UNIFORM_BUFFER, binding, id);
+    }
+    UniformBuffer(const UniformBuffer &) = delete;
+    UniformBuffer &operator=(const UniformBuffer &) = delete;
+
+    void update(const T &data) const {
+        GLState::instance().bindBuffer(GL_UNIFORM_BUFFER, id);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &data);
+    }
+};
+
+#endif
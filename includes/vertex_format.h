@@ -0,0 +1,198 @@
+#ifndef VERTEX_FORMAT_H
+#define VERTEX_FORMAT_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct Vertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texCoords;
+};
+
+struct Bounds {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+enum PositionFormat { POSITION_FLOAT, POSITION_HALF, POSITION_SNORM16 };
+enum NormalFormat { NORMAL_FLOAT, NORMAL_INT_2_10_10_10, NORMAL_OCTAHEDRAL };
+enum TexCoordFormat { TEXCOORD_FLOAT, TEXCOORD_UNORM16 };
+
+// GPU layout of a mesh's vertices. Meshes are stored and processed as
+// Vertex on the CPU and only packed on upload. SNORM16 positions are
+// relative to the mesh bounds and scaled back in the vertex shader through
+// the positionScale/positionOffset uniforms.
+struct VertexFormat {
+    PositionFormat position = POSITION_FLOAT;
+    NormalFormat normal = NORMAL_FLOAT;
+    TexCoordFormat texCoords = TEXCOORD_FLOAT;
+
+    // Import-time policy used by choose().
+    static inline bool quantize = true;
+    static inline bool halfPositions = false;
+    static inline bool octahedralNormals = false;
+    // Largest acceptable position error, in model units.
+    static inline float positionTolerance = 0.01f;
+
+    bool operator==(const VertexFormat &other) const {
+        return key() == other.key();
+    }
+    bool operator!=(const VertexFormat &other) const {
+        return key() != other.key();
+    }
+    std::uint32_t key() const {
+        return position | normal << 4 | texCoords << 8;
+    }
+    static VertexFormat fromKey(std::uint32_t key) {
+        return {static_cast<PositionFormat>(key & 15),
+                static_cast<NormalFormat>(key >> 4 & 15),
+                static_cast<TexCoordFormat>(key >> 8 & 15)};
+    }
+
+    bool valid() const {
+        return position <= POSITION_SNORM16 && normal <= NORMAL_OCTAHEDRAL &&
+               texCoords <= TEXCOORD_UNORM16;
+    }
+
+    GLsizei positionSize() const { return position == POSITION_FLOAT ? 12 : 8; }
+    GLsizei normalSize() const { return normal == NORMAL_FLOAT ? 12 : 4; }
+    GLsizei texCoordSize() const {
+        return texCoords == TEXCOORD_FLOAT ? 8 : 4;
+    }
+    GLsizei stride() const {
+        return positionSize() + normalSize() + texCoordSize();
+    }
+
+    // Most compact layout that stays within tolerance for these vertices.
+    static VertexFormat choose(const Vertex *vertices, size_t count,
+                               const Bounds &bounds) {
+        VertexFormat format;
+        if (!quantize || count == 0) return format;
+
+        glm::vec3 magnitude = glm::max(glm::abs(bounds.min),
+                                       glm::abs(bounds.max));
+        glm::vec3 extent = bounds.max - bounds.min;
+        float largest = glm::max(magnitude.x, glm::max(magnitude.y,
+                                                       magnitude.z));
+        float widest = glm::max(extent.x, glm::max(extent.y, extent.z));
+        // Half floats keep 11 significant bits; SNORM16 spans the bounds
+        // with 65535 steps.
+        if (halfPositions && largest / 2048.0f <= positionTolerance)
+            format.position = POSITION_HALF;
+        else if (widest / 65534.0f <= positionTolerance)
+            format.position = POSITION_SNORM16;
+
+        format.normal =
+            octahedralNormals ? NORMAL_OCTAHEDRAL : NORMAL_INT_2_10_10_10;
+
+        format.texCoords = TEXCOORD_UNORM16;
+        for (size_t i = 0; i < count; i++) {
+            const glm::vec2 &uv = vertices[i].texCoords;
+            if (uv.x < 0.0f || uv.x > 1.0f || uv.y < 0.0f || uv.y > 1.0f) {
+                format.texCoords = TEXCOORD_FLOAT;
+                break;
+            }
+        }
+        return format;
+    }
+
+    static glm::vec3 positionScale(const VertexFormat &format,
+                                   const Bounds &bounds) {
+        if (format.position != POSITION_SNORM16) return glm::vec3(1.0f);
+        return glm::max((bounds.max - bounds.min) * 0.5f, glm::vec3(1e-20f));
+    }
+    static glm::vec3 positionOffset(const VertexFormat &format,
+                                    const Bounds &bounds) {
+        if (format.position != POSITION_SNORM16) return glm::vec3(0.0f);
+        return (bounds.max + bounds.min) * 0.5f;
+    }
+
+    // Interleave vertices into out, which must hold count * stride() bytes.
+    void pack(const Vertex *vertices, size_t count, const Bounds &bounds,
+              unsigned char *out) const {
+        glm::vec3 scale = 1.0f / positionScale(*this, bounds);
+        glm::vec3 offset = positionOffset(*this, bounds);
+        for (size_t i = 0; i < count; i++) {
+            const Vertex &vertex = vertices[i];
+            if (position == POSITION_FLOAT)
+                write(out, vertex.position);
+            else if (position == POSITION_HALF)
+                write(out, glm::packHalf4x16(glm::vec4(vertex.position, 1.0f)));
+            else
+                write(out, glm::packSnorm4x16(glm::vec4(
+                               (vertex.position - offset) * scale, 0.0f)));
+
+            if (normal == NORMAL_FLOAT)
+                write(out, vertex.normal);
+            else if (normal == NORMAL_INT_2_10_10_10)
+                write(out, glm::packSnorm3x10_1x2(
+                               glm::vec4(glm::normalize(vertex.normal), 0.0f)));
+            else
+                write(out, glm::packSnorm2x16(encodeOctahedral(vertex.normal)));
+
+            if (texCoords == TEXCOORD_FLOAT)
+                write(out, vertex.texCoords);
+            else
+                write(out, glm::packUnorm2x16(vertex.texCoords));
+        }
+    }
+
+    // Attribute pointers for locations 0-2 into the bound GL_ARRAY_BUFFER.
+    void setAttributes() const {
+        const char *offset = nullptr;
+        if (position == POSITION_FLOAT)
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride(), offset);
+        else if (position == POSITION_HALF)
+            glVertexAttribPointer(0, 3, GL_HALF_FLOAT, GL_FALSE, stride(),
+                                  offset);
+        else
+            glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, stride(), offset);
+        offset += positionSize();
+
+        if (normal == NORMAL_FLOAT)
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride(), offset);
+        else if (normal == NORMAL_INT_2_10_10_10)
+            glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE,
+                                  stride(), offset);
+        else
+            glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, stride(), offset);
+        offset += normalSize();
+
+        if (texCoords == TEXCOORD_FLOAT)
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride(), offset);
+        else
+            glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride(),
+                                  offset);
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+    }
+
+    // Maps the unit sphere onto [-1, 1]^2; decoded in the vertex shader.
+    static glm::vec2 encodeOctahedral(glm::vec3 n) {
+        n /= glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+        glm::vec2 e(n.x, n.y);
+        if (n.z < 0.0f) {
+            glm::vec2 sign(e.x >= 0.0f ? 1.0f : -1.0f,
+                           e.y >= 0.0f ? 1.0f : -1.0f);
+            e = (1.0f - glm::abs(glm::vec2(e.y, e.x))) * sign;
+        }
+        return e;
+    }
+
+   private:
+    template <typename T>
+    static void write(unsigned char *&out, const T &value) {
+        std::memcpy(out, &value, sizeof(T));
+        out += sizeof(T);
+    }
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <frustum.h>
+#include <software_occlusion.h>
+#include <thread_pool.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Benchmark of SoftwareOcclusion on a procedural city: a grid of box
+// buildings acts as occluders for many small props scattered over the
+// streets, seen by a camera walking down a street and looking around.
+// Prints the time to rasterize the occluders and to test the props that
+// survive frustum culling, and the share of those the occlusion rejects,
+// for the SIMD and the scalar paths.
+//
+//   occlusion_bench [-j threads] [-n props] [-f frames] [-s WxH]
+
+struct Scene {
+    std::vector<Bounds> buildings;
+    std::vector<Bounds> props;
+};
+
+Scene makeCity(int props) {
+    const int blocks = 16;
+    const float spacing = 10.0f, size = 6.0f;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> height(8.0f, 30.0f);
+    std::uniform_real_distribution<float> position(0.0f, blocks * spacing);
+    std::uniform_real_distribution<float> extent(0.25f, 1.0f);
+
+    Scene scene;
+    for (int x = 0; x < blocks; x++) {
+        for (int z = 0; z < blocks; z++) {
+            glm::vec3 min(x * spacing, 0.0f, z * spacing);
+            scene.buildings.push_back(
+                {min, min + glm::vec3(size, height(rng), size)});
+        }
+    }
+    for (int i = 0; i < props; i++) {
+        glm::vec3 center(position(rng), 0.0f, position(rng));
+        glm::vec3 half(extent(rng), extent(rng), extent(rng));
+        center.y = half.y;
+        scene.props.push_back({center - half, center + half});
+    }
+    return scene;
+}
+
+struct Result {
+    double renderMs = 0.0;
+    double cullMs = 0.0;
+    size_t tested = 0;
+    size_t rejected = 0;
+    size_t triangles = 0;
+    std::vector<std::uint32_t> visible;
+};
+
+Result run(SoftwareOcclusion &occlusion, const Scene &scene, int frames) {
+    using Clock = std::chrono::steady_clock;
+    auto ms = [](Clock::duration duration) {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    };
+    Occluder unitBox = Occluder::box({glm::vec3(0.0f), glm::vec3(1.0f)});
+    glm::mat4 projection =
+        glm::perspective(glm::radians(60.0f), 2.0f, 0.1f, 500.0f);
+
+    Result result;
+    std::vector<Bounds> candidates;
+    std::vector<std::uint32_t> visible;
+    for (int frame = 0; frame < frames; frame++) {
+        // Walk down the street between the first two columns of blocks.
+        float t = float(frame) / frames;
+        glm::vec3 eye(8.0f, 1.7f, 2.0f + t * 150.0f);
+        float yaw = t * glm::radians(720.0f);
+        glm::vec3 front(glm::sin(yaw), 0.0f, glm::cos(yaw));
+        glm::mat4 viewProjection =
+            projection * glm::lookAt(eye, eye + front, glm::vec3(0, 1, 0));
+        Frustum frustum = Frustum::fromMatrix(viewProjection);
+        candidates.clear();
+        for (const Bounds &prop : scene.props)
+            if (frustum.intersects(prop)) candidates.push_back(prop);
+
+        auto start = Clock::now();
+        occlusion.begin(viewProjection);
+        for (const Bounds &building : scene.buildings) {
+            if (!frustum.intersects(building)) continue;
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), building.min);
+            occlusion.add(unitBox,
+                          glm::scale(model, building.max - building.min));
+        }
+        occlusion.render();
+        auto rendered = Clock::now();
+        occlusion.cull(candidates, visible);
+        auto culled = Clock::now();
+
+        result.renderMs += ms(rendered - start);
+        result.cullMs += ms(culled - rendered);
+        result.tested += candidates.size();
+        result.rejected += candidates.size() - visible.size();
+        result.triangles += occlusion.triangles();
+        result.visible.insert(result.visible.end(), visible.begin(),
+                              visible.end());
+    }
+    result.renderMs /= frames;
+    result.cullMs /= frames;
+    return result;
+}
+
+int main(int argc, char **argv) {
+    unsigned int threads = ThreadPool::defaultThreads();
+    int props = 100000, frames = 200, width = 256, height = 128;
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+            props = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-f") && i + 1 < argc) {
+            frames = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "-s") && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+                std::cerr << "ERROR BAD SIZE: " << argv[i] << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else {
+            std::cerr << "usage: occlusion_bench [-j threads] [-n props] "
+                         "[-f frames] [-s WxH]"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    Scene scene = makeCity(props);
+    // The calling thread renders and tests too.
+    ThreadPool pool(threads - 1);
+    SoftwareOcclusion occlusion(pool, width, height);
+    std::printf("%zu buildings, %zu props, %dx%d buffer, %u threads\n",
+                scene.buildings.size(), scene.props.size(), occlusion.width(),
+                occlusion.height(), threads);
+
+    Result results[2];
+    for (int simd = 1; simd >= 0; simd--) {
+        SoftwareOcclusion::simd = simd;
+        run(occlusion, scene, 10);
+        Result &result = results[simd];
+        result = run(occlusion, scene, frames);
+        std::printf(
+            "%-6s render %7.3f ms  cull %7.3f ms  %zu triangles  "
+            "rejected %zu of %zu (%.1f%%)\n",
+            simd ? "simd" : "scalar", result.renderMs, result.cullMs,
+            result.triangles / frames, result.rejected / frames,
+            result.tested / frames,
+            result.tested ? 100.0 * result.rejected / result.tested : 0.0);
+    }
+    if (results[0].visible != results[1].visible) {
+        std::cerr << "ERROR SIMD AND SCALAR RESULTS DIFFER" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+#include <GL/glew.h>
+
+#include <offscreen_context.h>
+#include <shader.h>
+#include <shader_variants.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+// Headless check of the program binary cache, meant for Mesa's llvmpipe
+// with no display. A cold start must compile and write a binary, a warm
+// start must link from that binary without compiling, and a truncated or
+// corrupt binary must fall back to compiling and be replaced. Links
+// against EGL; run it from the repository root.
+//
+//   shader_cache_check
+
+namespace fs = std::filesystem;
+
+struct Build {
+    bool linked;
+    double ms;
+};
+
+Build build() {
+    auto start = std::chrono::steady_clock::now();
+    Shader shader("./shaders/vertex.vert", "./shaders/fragment.frag",
+                  lightingDefines(), lightingPrelude());
+    GLint linked;
+    glGetProgramiv(shader.id, GL_LINK_STATUS, &linked);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    glDeleteProgram(shader.id);
+    return {linked == GL_TRUE, elapsed.count()};
+}
+
+std::string contents(const fs::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file),
+            std::istreambuf_iterator<char>()};
+}
+
+bool fail(const char *message) {
+    std::cerr << "ERROR " << message << std::endl;
+    return false;
+}
+
+// Replace the cached binary with data, build again and expect the cache to
+// be rewritten by a fresh compile.
+bool recovers(const fs::path &binary, const std::string &data,
+              const char *what) {
+    std::ofstream(binary, std::ios::binary) << data;
+    Build rebuilt = build();
+    std::printf("%-9s %8.2f ms\n", what, rebuilt.ms);
+    if (!rebuilt.linked) return fail("PROGRAM NOT LINKED AFTER BAD BINARY");
+    if (contents(binary) == data) return fail("BAD BINARY NOT REPLACED");
+    return true;
+}
+
+bool check(const fs::path &directory) {
+    Build cold = build();
+    std::printf("cold      %8.2f ms\n", cold.ms);
+    if (!cold.linked) return fail("PROGRAM NOT LINKED");
+    fs::path binary;
+    for (const fs::directory_entry &entry : fs::directory_iterator(directory))
+        binary = entry.path();
+    if (binary.empty()) return fail("NO BINARY WRITTEN");
+
+    // A warm start leaves the binary alone; recompiling would rewrite it.
+    fs::file_time_type stamp =
+        fs::last_write_time(binary) - std::chrono::hours(1);
+    fs::last_write_time(binary, stamp);
+    Build warm = build();
+    std::printf("warm      %8.2f ms\n", warm.ms);
+    if (!warm.linked) return fail("PROGRAM NOT LINKED");
+    if (fs::last_write_time(binary) != stamp)
+        return fail("BINARY NOT LOADED");
+
+    std::string valid = contents(binary);
+    return recovers(binary, valid.substr(0, 2), "truncated") &&
+           recovers(binary, valid.substr(0, sizeof(GLenum)) + "garbage",
+                    "corrupt");
+}
+
+int main() {
+    OffscreenContext context;
+    if (!context.ready()) return EXIT_FAILURE;
+    std::printf("%s\n",
+                reinterpret_cast<const char *>(glGetString(GL_RENDERER)));
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats == 0) {
+        // Mesa reports none while its shader cache is disabled.
+        std::printf("no program binary formats, cache unused\n");
+        return EXIT_SUCCESS;
+    }
+
+    fs::path directory = fs::temp_directory_path() / "shader_cache_check";
+    fs::remove_all(directory);
+    Shader::binaryCacheDirectory = directory;
+    bool passed = check(directory);
+    fs::remove_all(directory);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
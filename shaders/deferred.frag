@@ -0,0 +1,92 @@
+#version 430
+
+// Lights the G-buffer written by shaders/gbuffer.frag once per pixel, the
+// way shaders/fragment.frag lights each fragment.
+
+// Declarations, shadow lookups and clusterIndex() come from
+// shaders/lighting.glsl, inserted above.
+
+// Everything the lights need to know about the surface under a pixel.
+struct Surface {
+    vec3 position;
+    vec3 normal;
+    vec3 albedo;
+    vec3 specular;
+    float shiny;
+};
+
+uniform sampler2D gAlbedo;
+uniform sampler2D gSpecular;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;
+
+out vec4 fragColor;
+
+vec3 decodeNormal(vec2 encoded) {
+    vec3 n = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+vec3 shade(Surface surface, vec3 lightDirection, vec3 viewDirection, vec3 ambient, vec3 diffuse, vec3 specular, float intensity) {
+    float diff = max(dot(surface.normal, lightDirection), 0.0);
+    vec3 reflectDirection = reflect(-lightDirection, surface.normal);
+    float spec = pow(max(dot(viewDirection, reflectDirection), 0.0), surface.shiny);
+    return ambient * surface.albedo + (diffuse * diff * surface.albedo + specular * spec * surface.specular) * intensity;
+}
+
+vec3 computeDirectedLight(DirectedLight light, Surface surface, vec3 viewDirection, float shadow) {
+    vec3 lightDirection = normalize(-light.direction);
+    return shade(surface, lightDirection, viewDirection, light.ambient, light.diffuse, light.specular, shadow);
+}
+
+vec3 computePointLight(PointLight light, Surface surface, vec3 viewDirection) {
+    vec3 lightDirection = normalize(light.position - surface.position);
+    float distance = length(light.position - surface.position);
+    if (distance > light.radius) return vec3(0.0);
+    float attenuation = 1.0 / (light.coefficients.x + light.coefficients.y * distance + light.coefficients.z * distance * distance);
+    float shadow = pointShadow(light, surface.position, surface.normal);
+    return shade(surface, lightDirection, viewDirection, light.ambient, light.diffuse, light.specular, shadow) * attenuation;
+}
+
+vec3 computeSpotLight(SpotLight light, Surface surface, vec3 viewDirection) {
+    vec3 lightDirection = normalize(light.position - surface.position);
+    float theta = dot(lightDirection, normalize(-light.direction));
+    float epsilon = light.cutoff - light.outerCutoff;
+    float intensity = clamp((theta - light.outerCutoff) / epsilon, 0.0, 1.0);
+    float distance = length(light.position - surface.position);
+    float attenuation = 1.0 / (light.coefficients.x + light.coefficients.y * distance + light.coefficients.z * distance * distance);
+    float shadow = spotShadow(light, surface.position, surface.normal);
+    return shade(surface, lightDirection, viewDirection, light.ambient, light.diffuse, light.specular, intensity * shadow) * attenuation;
+}
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth == 1.0) discard;
+
+    vec2 screen = gl_FragCoord.xy / vec2(textureSize(gDepth, 0));
+    vec4 position = inverseViewProjection * vec4(vec3(screen, depth) * 2.0 - 1.0, 1.0);
+    vec4 specular = texelFetch(gSpecular, pixel, 0);
+    Surface surface;
+    surface.position = position.xyz / position.w;
+    surface.normal = decodeNormal(texelFetch(gNormal, pixel, 0).xy);
+    surface.albedo = texelFetch(gAlbedo, pixel, 0).rgb;
+    surface.specular = specular.rgb;
+    surface.shiny = specular.a * 255.0;
+
+    vec3 viewDirection = normalize(viewPos - surface.position);
+    float shadow = directedShadow(surface.position, surface.normal);
+    vec3 result = computeDirectedLight(directedLight, surface, viewDirection, shadow);
+    result += computeSpotLight(spotLight, surface, viewDirection);
+    uint cluster = clusterIndex(surface.position);
+    uint first = cluster * MAX_CLUSTER_LIGHTS;
+    for (uint i = 0; i < clusterCounts[cluster]; ++i) {
+        PointLight light = pointLights[clusterLights[first + i]];
+        result += computePointLight(light, surface, viewDirection);
+    }
+    fragColor = vec4(result, 1.0);
+    gl_FragDepth = depth;
+}
@@ -0,0 +1,4 @@
+#version 430
+
+// Depth-only pass, see includes/hiz_culler.h.
+void main() {}
@@ -1,4 +1,12 @@
-#version 400
+#version 430
+
+// Declarations, shadow lookups and clusterIndex() come from
+// shaders/lighting.glsl, inserted above.
+
+// Features ShaderVariants can compile out, all on by default.
+#ifndef HAS_SPECULAR_MAP
+#define HAS_SPECULAR_MAP 1
+#endif
 
 in vec3 normal;
 in vec3 fragPos;
@@ -6,74 +14,52 @@ in vec2 textureCoords;
 
 struct Material {
     sampler2D diffuse;
+#if HAS_SPECULAR_MAP
     sampler2D specular;
+#endif
     float shiny;
 };
 
-struct PointLight {
-    vec3 position;
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-
-    vec3 coefficients;
-};
-
-struct DirectedLight {
-    vec3 direction;
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
-struct SpotLight {
-    vec3 position;
-    vec3 direction;
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-
-    vec3 coefficients;
-    float cutoff;
-    float outerCutoff;
-};
-
 uniform Material material;
-#define POINT_LIGHTS 4
-uniform PointLight pointLights[POINT_LIGHTS];
-uniform DirectedLight directedLight;
-uniform SpotLight spotLight;
-uniform vec3 viewPos;
 
 out vec4 fragColor;
 
-vec3 computeDirectedLight(DirectedLight light, vec3 normal, vec3 viewDirection){
+// Without a specular map the material has no highlights.
+vec3 computeSpecular(vec3 color, vec3 normal, vec3 lightDirection, vec3 viewDirection) {
+#if HAS_SPECULAR_MAP
+    vec3 reflectDirection = reflect(-lightDirection, normal);
+    float spec = pow(max(dot(viewDirection, reflectDirection), 0.0), material.shiny);
+    return color * spec * vec3(texture(material.specular, textureCoords));
+#else
+    return vec3(0.0);
+#endif
+}
+
+vec3 computeDirectedLight(DirectedLight light, vec3 normal, vec3 viewDirection, float shadow){
     vec3 lightDirection = normalize(-light.direction);
     float diff = max(dot(normal, lightDirection), 0.0);
     vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, textureCoords)) ;
     vec3 ambient = light.ambient * vec3(texture(material.diffuse, textureCoords));
 
-    vec3 reflectDirection = reflect(-lightDirection, normal);
-    float spec = pow(max(dot(viewDirection, reflectDirection), 0.0), material.shiny);
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, textureCoords)) ;
+    vec3 specular = computeSpecular(light.specular, normal, lightDirection, viewDirection);
 
-    return ambient + diffuse + specular;
+    return ambient + (diffuse + specular) * shadow;
 }
 
 vec3 computePointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDirection) {
     vec3 lightDirection = normalize(light.position - fragPos);
     float distance = length(light.position - fragPos);
+    if (distance > light.radius) return vec3(0.0);
     float attenuation = 1.0 / (light.coefficients.x + light.coefficients.y * distance + light.coefficients.z * distance * distance);
 
     float diff = max(dot(normal, lightDirection), 0.0);
     vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, textureCoords)) ;
     vec3 ambient = light.ambient * vec3(texture(material.diffuse, textureCoords));
 
-    vec3 reflectDirection = reflect(-lightDirection, normal);
-    float spec = pow(max(dot(viewDirection, reflectDirection), 0.0), material.shiny);
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, textureCoords)) ;
+    vec3 specular = computeSpecular(light.specular, normal, lightDirection, viewDirection);
 
-    return (ambient + diffuse + specular) * attenuation;
+    float shadow = pointShadow(light, fragPos, normal);
+    return (ambient + (diffuse + specular) * shadow) * attenuation;
 }
 
 vec3 computeSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDirection) {
@@ -87,12 +73,11 @@ vec3 computeSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDirec
     vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, textureCoords)) ;
     vec3 ambient = light.ambient * vec3(texture(material.diffuse, textureCoords));
 
-    vec3 reflectDirection = reflect(-lightDirection, normal);
-    float spec = pow(max(dot(viewDirection, reflectDirection), 0.0), material.shiny);
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, textureCoords)) ;
+    vec3 specular = computeSpecular(light.specular, normal, lightDirection, viewDirection);
 
-    diffuse *= intensity;
-    specular *= intensity;
+    float shadow = spotShadow(light, fragPos, normal);
+    diffuse *= intensity * shadow;
+    specular *= intensity * shadow;
     return (ambient + diffuse + specular) * attenuation;
 }
 
@@ -100,10 +85,14 @@ void main() {
     vec3 norm = normalize(normal);
     vec3 viewDirection = normalize(viewPos - fragPos);
 
-    vec3 result = computeDirectedLight(directedLight, norm, viewDirection);
+    float shadow = directedShadow(fragPos, norm);
+    vec3 result = computeDirectedLight(directedLight, norm, viewDirection, shadow);
     result += computeSpotLight(spotLight, norm, fragPos, viewDirection);
-    for(int i = 0; i < POINT_LIGHTS; ++i){
-        result += computePointLight(pointLights[i], norm, fragPos, viewDirection);
+    uint cluster = clusterIndex(fragPos);
+    uint first = cluster * MAX_CLUSTER_LIGHTS;
+    for (uint i = 0; i < clusterCounts[cluster]; ++i) {
+        PointLight light = pointLights[clusterLights[first + i]];
+        result += computePointLight(light, norm, fragPos, viewDirection);
     }
     fragColor = vec4(result, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,7 @@
+#version 430
+
+// One triangle covering the viewport, made from gl_VertexID alone.
+void main() {
+    vec2 position = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 4.0 - 1.0;
+    gl_Position = vec4(position, 0.0, 1.0);
+}
@@ -0,0 +1,45 @@
+#version 430
+
+// Features ShaderVariants can compile out, all on by default.
+#ifndef HAS_SPECULAR_MAP
+#define HAS_SPECULAR_MAP 1
+#endif
+
+in vec3 normal;
+in vec3 fragPos;
+in vec2 textureCoords;
+
+struct Material {
+    sampler2D diffuse;
+#if HAS_SPECULAR_MAP
+    sampler2D specular;
+#endif
+    float shiny;
+};
+
+uniform Material material;
+
+// See GBuffer in includes/gbuffer.h.
+layout (location = 0) out vec4 albedo;
+layout (location = 1) out vec4 specular;
+layout (location = 2) out vec2 packedNormal;
+
+// Inverse of decodeNormal() in shaders/vertex.vert.
+vec2 encodeNormal(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0,
+                                        n.y >= 0.0 ? 1.0 : -1.0);
+    return n.xy;
+}
+
+void main() {
+    albedo = vec4(vec3(texture(material.diffuse, textureCoords)), 1.0);
+#if HAS_SPECULAR_MAP
+    specular = vec4(vec3(texture(material.specular, textureCoords)),
+                    material.shiny / 255.0);
+#else
+    specular = vec4(vec3(0.0), material.shiny / 255.0);
+#endif
+    packedNormal = encodeNormal(normalize(normal));
+}
@@ -0,0 +1,51 @@
+#version 430
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTextureCoords;
+// Index of this draw in the Draws buffer, fed through baseInstance.
+layout (location = 10) in uint aDrawIndex;
+
+layout (std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+};
+
+// See DrawData in includes/indirect_batch.h.
+struct DrawData {
+    mat4 model;
+    mat4 normalModel;
+    vec4 positionScale;
+    vec4 positionOffset;
+    uint octahedralNormals;
+    uint material;
+};
+
+layout (std430, binding = 0) readonly buffer Draws {
+    DrawData draws[];
+};
+
+vec3 decodeNormal(vec3 encoded, bool octahedral) {
+    if (!octahedral) return encoded;
+    vec3 n = vec3(encoded.xy, 1.0 - abs(encoded.x) - abs(encoded.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+out vec3 normal;
+out vec3 fragPos;
+out vec2 textureCoords;
+flat out uint material;
+
+void main() {
+    DrawData draw = draws[aDrawIndex];
+    vec3 position = draw.positionOffset.xyz + draw.positionScale.xyz * aPos;
+    gl_Position = projection * view * draw.model * vec4(position, 1.0f);
+    normal = mat3(draw.normalModel) *
+             decodeNormal(aNormal, draw.octahedralNormals != 0u);
+    fragPos = vec3(draw.model * vec4(position, 1.0));
+    textureCoords = aTextureCoords;
+    material = draw.material;
+}
@@ -0,0 +1,39 @@
+#version 400
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTextureCoords;
+layout (location = 3) in mat4 aModel;
+layout (location = 7) in mat3 aNormalModel;
+
+layout (std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+};
+
+// Per-mesh dequantization, see VertexFormat. The defaults leave float
+// vertices untouched.
+uniform vec3 positionScale = vec3(1.0);
+uniform vec3 positionOffset = vec3(0.0);
+uniform bool octahedralNormals = false;
+
+vec3 decodeNormal(vec3 encoded) {
+    if (!octahedralNormals) return encoded;
+    vec3 n = vec3(encoded.xy, 1.0 - abs(encoded.x) - abs(encoded.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+out vec3 normal;
+out vec3 fragPos;
+out vec2 textureCoords;
+
+void main() {
+    vec3 position = positionOffset + positionScale * aPos;
+    gl_Position = projection * view * aModel * vec4(position, 1.0f);
+    normal = aNormalModel * decodeNormal(aNormal);
+    fragPos = vec3(aModel * vec4(position, 1.0));
+    textureCoords = aTextureCoords;
+}
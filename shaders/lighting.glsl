@@ -0,0 +1,166 @@
+// Declarations and shadow lookups shared by the lighting fragment shaders,
+// shaders/fragment.frag and shaders/deferred.frag. Shader inserts this
+// after the #version line and the injected defines, so it has no #version
+// of its own. MAX_CLUSTER_LIGHTS and MAX_CASCADES come from
+// lightingDefines().
+
+// Features ShaderVariants can compile out, all on by default.
+#ifndef SHADOWS
+#define SHADOWS 1
+#endif
+
+struct PointLight {
+    vec3 position;
+    float radius;
+    vec3 ambient;
+    int shadow;
+    vec3 diffuse;
+    vec3 specular;
+
+    vec3 coefficients;
+};
+
+struct DirectedLight {
+    vec3 direction;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+struct SpotLight {
+    vec3 position;
+    vec3 direction;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+
+    vec3 coefficients;
+    float cutoff;
+    float outerCutoff;
+    int shadow;
+};
+
+layout (std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+};
+
+layout (std140) uniform Lights {
+    DirectedLight directedLight;
+    SpotLight spotLight;
+    // Grid size and point light count; tile size in pixels, then the log
+    // depth scale and bias. See LightClusters::assign().
+    uvec4 clusterGrid;
+    vec4 clusterScale;
+    // Directed light shadow cascades, see CascadedShadows::apply().
+    mat4 cascadeMatrices[MAX_CASCADES];
+    vec4 cascadeSplits;
+    vec4 cascadeTexels;
+};
+
+uniform sampler2DArrayShadow shadowMap;
+
+// Point and spot light shadow tiles, see ShadowAtlas in
+// includes/shadow_atlas.h.
+struct ShadowTile {
+    mat4 matrix;
+    vec4 rect;
+    float texelScale;
+};
+
+layout (std430, binding = 7) readonly buffer ShadowTiles {
+    ShadowTile shadowTiles[];
+};
+
+uniform sampler2DShadow shadowAtlas;
+
+// Point lights binned into view space clusters by
+// shaders/cluster_lights.comp.
+layout (std430, binding = 3) readonly buffer PointLights {
+    PointLight pointLights[];
+};
+
+layout (std430, binding = 5) readonly buffer ClusterCounts {
+    uint clusterCounts[];
+};
+
+layout (std430, binding = 6) readonly buffer ClusterLights {
+    uint clusterLights[];
+};
+
+// Point light clusters are indexed by the pixel and the log of its view
+// depth, as LightClusters::assign() lays them out.
+uint clusterIndex(vec3 position) {
+    float depth = -(view * vec4(position, 1.0)).z;
+    uvec3 cluster = uvec3(gl_FragCoord.xy / clusterScale.xy,
+                          max(log(depth) * clusterScale.z + clusterScale.w, 0.0));
+    cluster = min(cluster, clusterGrid.xyz - 1u);
+    return cluster.x + clusterGrid.x * (cluster.y + clusterGrid.y * cluster.z);
+}
+
+#if SHADOWS
+// Fraction of the directed light reaching position, from the first
+// cascade covering it. Moving the lookup out along the normal keeps lit
+// surfaces from shadowing themselves.
+float directedShadow(vec3 position, vec3 normal) {
+    float depth = -(view * vec4(position, 1.0)).z;
+    vec2 texel = 0.5 / vec2(textureSize(shadowMap, 0).xy);
+    for (int i = 0; i < MAX_CASCADES; i++) {
+        if (depth > cascadeSplits[i]) continue;
+        vec3 offset = normal * cascadeTexels[i] * 1.5;
+        vec4 coords = cascadeMatrices[i] * vec4(position + offset, 1.0);
+        if (any(greaterThan(abs(coords.xyz - 0.5), vec3(0.5)))) continue;
+        float lit = 0.0;
+        for (int x = -1; x <= 1; x += 2)
+            for (int y = -1; y <= 1; y += 2)
+                lit += texture(shadowMap, vec4(coords.xy + vec2(x, y) * texel, i, coords.z));
+        return lit * 0.25;
+    }
+    return 1.0;
+}
+
+// Fraction of a light reaching position through one of its shadow atlas
+// tiles, with the same normal offset as the cascades.
+float tileShadow(int index, vec3 position, vec3 normal) {
+    ShadowTile tile = shadowTiles[index];
+    float depth = (tile.matrix * vec4(position, 1.0)).w;
+    vec3 offset = normal * tile.texelScale * depth * 1.5;
+    vec4 coords = tile.matrix * vec4(position + offset, 1.0);
+    if (coords.w <= 0.0) return 1.0;
+    coords.xyz /= coords.w;
+    if (coords.z > 1.0) return 1.0;
+    vec2 texel = 0.5 / vec2(textureSize(shadowAtlas, 0));
+    float lit = 0.0;
+    for (int x = -1; x <= 1; x += 2)
+        for (int y = -1; y <= 1; y += 2) {
+            vec2 uv = clamp(coords.xy + vec2(x, y) * texel, tile.rect.xy, tile.rect.zw);
+            lit += texture(shadowAtlas, vec3(uv, coords.z));
+        }
+    return lit * 0.25;
+}
+
+// Point lights have a tile per cube face: +X, -X, +Y, -Y, +Z, -Z.
+float pointShadow(PointLight light, vec3 position, vec3 normal) {
+    if (light.shadow < 0) return 1.0;
+    vec3 direction = position - light.position;
+    vec3 size = abs(direction);
+    int face;
+    if (size.x >= size.y && size.x >= size.z)
+        face = direction.x >= 0.0 ? 0 : 1;
+    else if (size.y >= size.z)
+        face = direction.y >= 0.0 ? 2 : 3;
+    else
+        face = direction.z >= 0.0 ? 4 : 5;
+    return tileShadow(light.shadow + face, position, normal);
+}
+
+float spotShadow(SpotLight light, vec3 position, vec3 normal) {
+    if (light.shadow < 0) return 1.0;
+    return tileShadow(light.shadow, position, normal);
+}
+#else
+float directedShadow(vec3 position, vec3 normal) { return 1.0; }
+float pointShadow(PointLight light, vec3 position, vec3 normal) { return 1.0; }
+float spotShadow(SpotLight light, vec3 position, vec3 normal) { return 1.0; }
+#endif